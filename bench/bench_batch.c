@@ -0,0 +1,143 @@
+/** bench_batch.c - Batched versus one at a time lookups on large trees.
+
+Copyright (c) 2024 Michael Berry
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "../include/bst.h"
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LOOKUPS 4000000
+#define BATCH 4096
+
+uint64_t next_random(uint64_t *);
+double now(void);
+void bench(size_t);
+
+/**
+ * main:
+ *      Benchmark each tree size given on the command line, by default
+ *      1M and 10M nodes. Larger sizes such as 100M, which needs roughly
+ *      5GB of memory, must be asked for explicitly.
+ */
+int main(int argc, char **argv) {
+    signal(SIGSEGV, sig_seg);
+
+    printf("%12s %14s %14s %10s\n", "nodes", "scalar ns", "batch ns",
+           "speedup");
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            bench(strtoul(argv[i], NULL, 10));
+        }
+    } else {
+        bench(1000000);
+        bench(10000000);
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * next_random:
+ *      xorshift64* generator, reproducible across runs.
+ */
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * now:
+ *      Monotonic time in seconds.
+ */
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * bench:
+ *      Build a tree of the even numbers below 2 * n and time random
+ *      lookups, half of which miss, one at a time and in batches.
+ */
+void bench(size_t n) {
+    int *values = malloc(n * sizeof(int));
+    int *keys = malloc(LOOKUPS * sizeof(int));
+    void **results = malloc(BATCH * sizeof(void *));
+    if (!values || !keys || !results) {
+        error_syscall("Unable to allocate benchmark input");
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        values[i] = (int)(2 * i);
+    }
+
+    bst_pool *pool = bst_pool_new(sizeof(int), 0, true);
+    bst_allocator alloc = bst_pool_allocator(pool);
+    bst_tree *tree = bst_tree_new_alloc(sizeof(int), compare_int, NULL, &alloc);
+    bst_tree_build_from_sorted(tree, values, n);
+    free(values);
+
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < LOOKUPS; i++) {
+        keys[i] = (int)(next_random(&state) % (2 * n));
+    }
+
+    size_t scalar_found = 0;
+    double start = now();
+    for (size_t i = 0; i < LOOKUPS; i++) {
+        scalar_found += bst_tree_lookup(tree, &keys[i]) != NULL;
+    }
+    double scalar = now() - start;
+
+    size_t batch_found = 0;
+    start = now();
+    for (size_t i = 0; i < LOOKUPS; i += BATCH) {
+        size_t m = LOOKUPS - i < BATCH ? LOOKUPS - i : BATCH;
+
+        bst_lookup_batch(tree, keys + i, m, results);
+        for (size_t j = 0; j < m; j++) {
+            batch_found += results[j] != NULL;
+        }
+    }
+    double batch = now() - start;
+
+    if (scalar_found != batch_found) {
+        error_quit("batched lookups found %zu keys, scalar found %zu",
+                   batch_found, scalar_found);
+    }
+
+    printf("%12zu %14.1f %14.1f %9.2fx\n", n, scalar * 1e9 / LOOKUPS,
+           batch * 1e9 / LOOKUPS, scalar / batch);
+    fflush(stdout);
+
+    bst_tree_delete(tree, NULL);
+    bst_pool_delete(pool);
+    free(results);
+    free(keys);
+}
@@ -0,0 +1,163 @@
+/** bench_frozen.c - Lookup throughput of frozen snapshots against live trees.
+
+Copyright (c) 2024 Michael Berry
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "../include/bst.h"
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LOOKUPS 4000000
+
+uint64_t next_random(uint64_t *);
+double now(void);
+void bench(size_t);
+
+// Search kernels of bst_frozen_int timed after the generic snapshot
+static const char *const kernels[] = {"scalar", "sse2", "avx2"};
+
+/**
+ * main:
+ *      Benchmark each tree size given on the command line, by default
+ *      1M and 10M nodes.
+ */
+int main(int argc, char **argv) {
+    signal(SIGSEGV, sig_seg);
+
+    printf("%12s %10s %10s %10s %10s %10s\n", "nodes", "tree ns", "frozen ns",
+           "scalar ns", "sse2 ns", "avx2 ns");
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            bench(strtoul(argv[i], NULL, 10));
+        }
+    } else {
+        bench(1000000);
+        bench(10000000);
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * next_random:
+ *      xorshift64* generator, reproducible across runs.
+ */
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * now:
+ *      Monotonic time in seconds.
+ */
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * bench:
+ *      Build a tree of the even numbers below 2 * n, freeze it and time
+ *      random lookups, half of which miss, against the tree, the generic
+ *      snapshot and each int snapshot kernel the CPU supports.
+ */
+void bench(size_t n) {
+    int *values = malloc(n * sizeof(int));
+    int *keys = malloc(LOOKUPS * sizeof(int));
+    if (!values || !keys) {
+        error_syscall("Unable to allocate benchmark input");
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        values[i] = (int)(2 * i);
+    }
+
+    bst_pool *pool = bst_pool_new(sizeof(int), 0, true);
+    bst_allocator alloc = bst_pool_allocator(pool);
+    bst_tree *tree = bst_tree_new_alloc(sizeof(int), compare_int, NULL, &alloc);
+    bst_tree_build_from_sorted(tree, values, n);
+    bst_frozen *frozen = bst_freeze(tree);
+    bst_frozen_int *ints = bst_freeze_int(tree);
+    free(values);
+
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < LOOKUPS; i++) {
+        keys[i] = (int)(next_random(&state) % (2 * n));
+    }
+
+    size_t tree_found = 0;
+    double start = now();
+    for (size_t i = 0; i < LOOKUPS; i++) {
+        tree_found += bst_tree_lookup(tree, &keys[i]) != NULL;
+    }
+    double tree_time = now() - start;
+
+    size_t frozen_found = 0;
+    start = now();
+    for (size_t i = 0; i < LOOKUPS; i++) {
+        frozen_found += bst_frozen_lookup(frozen, &keys[i]) != NULL;
+    }
+    double frozen_time = now() - start;
+
+    if (tree_found != frozen_found) {
+        error_quit("snapshot found %zu keys, tree found %zu", frozen_found,
+                   tree_found);
+    }
+
+    printf("%12zu %10.1f %10.1f", n, tree_time * 1e9 / LOOKUPS,
+           frozen_time * 1e9 / LOOKUPS);
+
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(*kernels); k++) {
+        if (!bst_frozen_int_use_kernel(ints, kernels[k])) {
+            printf(" %10s", "-");
+            continue;
+        }
+
+        size_t int_found = 0;
+        start = now();
+        for (size_t i = 0; i < LOOKUPS; i++) {
+            int_found += bst_frozen_int_contains(ints, keys[i]);
+        }
+        double int_time = now() - start;
+
+        if (int_found != tree_found) {
+            error_quit("%s kernel found %zu keys, tree found %zu", kernels[k],
+                       int_found, tree_found);
+        }
+        printf(" %10.1f", int_time * 1e9 / LOOKUPS);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    bst_frozen_int_delete(ints);
+    bst_frozen_delete(frozen);
+    bst_tree_delete(tree, NULL);
+    bst_pool_delete(pool);
+    free(keys);
+}
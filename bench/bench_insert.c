@@ -0,0 +1,159 @@
+/** bench_insert.c - Comparator calls and time per insert into a libbst tree.
+
+Copyright (c) 2024 Michael Berry
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "../include/bst.h"
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_COUNT 1000000
+
+static size_t calls;
+
+result counting_int(const void *, const void *);
+result counting_str(const void *, const void *);
+result counting_str_prefix(const void *, const void *);
+uint64_t next_random(uint64_t *);
+double now(void);
+void bench(const char *, size_t, const void *, size_t, comparator);
+
+int main(int argc, char **argv) {
+    size_t n = DEFAULT_COUNT;
+
+    signal(SIGSEGV, sig_seg);
+
+    if (argc > 1) {
+        n = strtoul(argv[1], NULL, 10);
+    }
+
+    int *ints = malloc(n * sizeof(int));
+    char **strs = malloc(n * sizeof(char *));
+    char *pool = malloc(n * 24);
+    bst_str *keys = malloc(n * sizeof(bst_str));
+    if (!ints || !strs || !pool || !keys) {
+        error_syscall("Unable to allocate benchmark input");
+    }
+
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < n; i++) {
+        ints[i] = (int)(next_random(&state) >> 33);
+        strs[i] = pool + i * 24;
+        snprintf(strs[i], 24, "key/%016llx",
+                 (unsigned long long)next_random(&state));
+    }
+
+    printf("%-16s %12s %14s %12s\n", "workload", "inserts", "cmp/insert",
+           "ns/insert");
+    bench("random int", n, ints, sizeof(int), counting_int);
+    for (size_t i = 0; i < n; i++) {
+        ints[i] = (int)i;
+    }
+    bench("sorted int", n, ints, sizeof(int), counting_int);
+    bench("random string", n, strs, sizeof(char *), counting_str);
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = bst_str_key(strs[i]);
+    }
+    bench("prefix string", n, keys, sizeof(bst_str), counting_str_prefix);
+
+    free(keys);
+    free(pool);
+    free(strs);
+    free(ints);
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * counting_int:
+ *      compare_int that counts its calls.
+ */
+result counting_int(const void *a, const void *b) {
+    calls++;
+    return compare_int(a, b);
+}
+
+/**
+ * counting_str:
+ *      compare_str that counts its calls.
+ */
+result counting_str(const void *a, const void *b) {
+    calls++;
+    return compare_str(a, b);
+}
+
+/**
+ * counting_str_prefix:
+ *      compare_str_prefix that counts its calls.
+ */
+result counting_str_prefix(const void *a, const void *b) {
+    calls++;
+    return compare_str_prefix(a, b);
+}
+
+/**
+ * next_random:
+ *      xorshift64* generator, reproducible across runs.
+ */
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * now:
+ *      Monotonic time in seconds.
+ */
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * bench:
+ *      Insert n elements of size bytes into a fresh tree and report
+ *      comparator calls and time per insert.
+ */
+void bench(const char *name, size_t n, const void *elems, size_t size,
+           comparator cmp) {
+    bst_tree *tree = bst_tree_new(size, cmp, NULL);
+    const unsigned char *elem = elems;
+
+    calls = 0;
+    double start = now();
+    for (size_t i = 0; i < n; i++) {
+        bst_tree_insert(tree, elem + i * size);
+    }
+    double elapsed = now() - start;
+
+    printf("%-16s %12zu %14.2f %12.1f\n", name, bst_tree_size(tree),
+           (double)calls / n, elapsed * 1e9 / n);
+    fflush(stdout);
+
+    bst_tree_delete(tree, NULL);
+}
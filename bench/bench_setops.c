@@ -0,0 +1,128 @@
+/** bench_setops.c - Merging trees by union against reinserting every element.
+
+Copyright (c) 2024 Michael Berry
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "../include/bst.h"
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+double now(void);
+bst_tree *shard(size_t, size_t, size_t);
+void bench(size_t);
+
+/**
+ * main:
+ *      Benchmark each shard size given on the command line, by default
+ *      100K and 1M elements per shard.
+ */
+int main(int argc, char **argv) {
+    signal(SIGSEGV, sig_seg);
+
+    printf("%12s %14s %14s %10s\n", "shard", "reinsert ms", "union ms",
+           "speedup");
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            bench(strtoul(argv[i], NULL, 10));
+        }
+    } else {
+        bench(100000);
+        bench(1000000);
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * now:
+ *      Monotonic time in seconds.
+ */
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * shard:
+ *      Tree of n ints starting at first, step apart.
+ */
+bst_tree *shard(size_t n, size_t first, size_t step) {
+    int *values = malloc(n * sizeof(int));
+    if (!values) {
+        error_syscall("Unable to allocate benchmark input");
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        values[i] = (int)(first + i * step);
+    }
+
+    bst_tree *tree = bst_tree_new(sizeof(int), compare_int, NULL);
+    bst_tree_build_from_sorted(tree, values, n);
+    free(values);
+
+    return tree;
+}
+
+/**
+ * bench:
+ *      Merge two interleaved shards of n elements, one a third shared
+ *      with the other, by reinserting and by bst_union.
+ */
+void bench(size_t n) {
+    bst_tree *dst = shard(n, 0, 3);
+    bst_tree *src = shard(n, 1, 2);
+    bst_iter it;
+    const int *elem;
+
+    double start = now();
+    bst_iter_init(&it, src);
+    while ((elem = bst_iter_next(&it))) {
+        bst_tree_insert(dst, elem);
+    }
+    double reinsert = now() - start;
+    size_t expected = bst_tree_size(dst);
+
+    bst_tree_delete(dst, NULL);
+    bst_tree_delete(src, NULL);
+    dst = shard(n, 0, 3);
+    src = shard(n, 1, 2);
+
+    start = now();
+    bst_union(dst, src);
+    double joined = now() - start;
+
+    if (bst_tree_size(dst) != expected) {
+        error_quit("union has %zu elements, reinsertion %zu",
+                   bst_tree_size(dst), expected);
+    }
+
+    printf("%12zu %14.1f %14.1f %9.2fx\n", n, reinsert * 1e3, joined * 1e3,
+           reinsert / joined);
+    fflush(stdout);
+
+    bst_tree_delete(dst, NULL);
+    bst_tree_delete(src, NULL);
+}
@@ -0,0 +1,178 @@
+/** bench_threads.c - Lookup throughput of a shared tree as threads are added.
+
+Copyright (c) 2024 Michael Berry
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "../include/bst.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NODES 1000000
+#define LOOKUPS 2000000
+
+// Work for one benchmark thread
+typedef struct worker {
+    const bst_tree *tree;
+    pthread_mutex_t *mutex; // taken around each lookup when not NULL
+    uint64_t seed;
+    size_t found;
+} worker;
+
+uint64_t next_random(uint64_t *);
+double now(void);
+void *lookups(void *);
+double run(const bst_tree *, pthread_mutex_t *, size_t);
+
+/**
+ * main:
+ *      Time lookups on one shared tree from 1 to N threads, doubling each
+ *      step, N being the number of online CPUs unless given. Each thread
+ *      does the same number of lookups, so perfect scaling keeps the
+ *      per thread rate flat.
+ */
+int main(int argc, char **argv) {
+    signal(SIGSEGV, sig_seg);
+
+    long max_threads = argc > 1 ? strtol(argv[1], NULL, 10)
+                                : sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_threads < 1) {
+        max_threads = 1;
+    }
+
+    int *values = malloc(NODES * sizeof(int));
+    if (!values) {
+        error_syscall("Unable to allocate benchmark input");
+    }
+    for (size_t i = 0; i < NODES; i++) {
+        values[i] = (int)(2 * i);
+    }
+
+    bst_tree *tree = bst_tree_new(sizeof(int), compare_int, NULL);
+    bst_tree_build_from_sorted(tree, values, NODES);
+    free(values);
+
+    // The same tree behind one global mutex, as callers had to before
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    double mutex_base = 0, rwlock_base = 0;
+
+    bst_tree_make_concurrent(tree);
+    printf("%8s %14s %10s %14s %10s\n", "threads", "rwlock Mops", "scaling",
+           "mutex Mops", "scaling");
+    for (size_t t = 1; t <= (size_t)max_threads; t *= 2) {
+        double rwlock = run(tree, NULL, t);
+        double mutex_rate = run(tree, &mutex, t);
+
+        if (t == 1) {
+            rwlock_base = rwlock;
+            mutex_base = mutex_rate;
+        }
+        printf("%8zu %14.2f %9.2fx %14.2f %9.2fx\n", t, rwlock,
+               rwlock / rwlock_base, mutex_rate, mutex_rate / mutex_base);
+        fflush(stdout);
+
+        // Always finish on the full thread count
+        if (t < (size_t)max_threads && t * 2 > (size_t)max_threads) {
+            t = (size_t)max_threads / 2;
+        }
+    }
+
+    bst_tree_delete(tree, NULL);
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * next_random:
+ *      xorshift64* generator, reproducible across runs.
+ */
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * now:
+ *      Monotonic time in seconds.
+ */
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * lookups:
+ *      Thread body, random lookups of which half miss.
+ */
+void *lookups(void *arg) {
+    worker *w = arg;
+
+    for (size_t i = 0; i < LOOKUPS; i++) {
+        int key = (int)(next_random(&w->seed) % (2 * NODES));
+
+        if (w->mutex) {
+            pthread_mutex_lock(w->mutex);
+        }
+        w->found += bst_tree_lookup(w->tree, &key) != NULL;
+        if (w->mutex) {
+            pthread_mutex_unlock(w->mutex);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * run:
+ *      Run threads lookup workers and return millions of lookups per
+ *      second across all of them.
+ */
+double run(const bst_tree *tree, pthread_mutex_t *mutex, size_t threads) {
+    pthread_t *ids = malloc(threads * sizeof(pthread_t));
+    worker *workers = malloc(threads * sizeof(worker));
+    if (!ids || !workers) {
+        error_syscall("Unable to allocate benchmark threads");
+    }
+
+    double start = now();
+    for (size_t i = 0; i < threads; i++) {
+        workers[i] = (worker){tree, mutex, 0x9e3779b97f4a7c15ULL + i, 0};
+        if (pthread_create(&ids[i], NULL, lookups, &workers[i])) {
+            error_quit("Unable to start benchmark thread %zu", i);
+        }
+    }
+    for (size_t i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    free(workers);
+    free(ids);
+
+    return threads * LOOKUPS / elapsed / 1e6;
+}
@@ -0,0 +1,109 @@
+/** bench_typed.c - Generic versus macro generated typed tree lookups.
+
+Copyright (c) 2024 Michael Berry
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "../include/bst_typed.h"
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_COUNT 1000000
+
+BST_DEFINE(int_set, int, BST_CMP_NUMERIC(a, b))
+
+uint64_t next_random(uint64_t *);
+double now(void);
+
+int main(int argc, char **argv) {
+    size_t n = DEFAULT_COUNT;
+
+    signal(SIGSEGV, sig_seg);
+
+    if (argc > 1) {
+        n = strtoul(argv[1], NULL, 10);
+    }
+
+    int *keys = malloc(n * sizeof(int));
+    if (!keys) {
+        error_syscall("Unable to allocate benchmark input");
+    }
+
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < n; i++) {
+        keys[i] = (int)(next_random(&state) >> 33);
+    }
+
+    bst_tree *tree = bst_tree_new(sizeof(int), compare_int, NULL);
+    int_set set;
+    int_set_init(&set);
+
+    for (size_t i = 0; i < n; i++) {
+        bst_tree_insert(tree, &keys[i]);
+        int_set_insert(&set, keys[i]);
+    }
+
+    size_t found = 0;
+    double start = now();
+    for (size_t i = 0; i < n; i++) {
+        found += bst_tree_lookup(tree, &keys[i]) != NULL;
+    }
+    double generic = now() - start;
+
+    start = now();
+    for (size_t i = 0; i < n; i++) {
+        found += int_set_lookup(&set, keys[i]) != NULL;
+    }
+    double typed = now() - start;
+
+    printf("%-16s %12s %12s\n", "lookup", "found", "ns/lookup");
+    printf("%-16s %12zu %12.1f\n", "generic", found / 2, generic * 1e9 / n);
+    printf("%-16s %12zu %12.1f\n", "typed", found / 2, typed * 1e9 / n);
+
+    int_set_clear(&set);
+    bst_tree_delete(tree, NULL);
+    free(keys);
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * next_random:
+ *      xorshift64* generator, reproducible across runs.
+ */
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * now:
+ *      Monotonic time in seconds.
+ */
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -86,7 +86,8 @@ int main(int argc __attribute__((unused)),
  *      Calculate the Fibonacci series up to limit.
  */
 void fib_to_limit(size_t limit) {
-    bst_node *fibs = NULL;
+    int values[MAXGEN];
+    size_t n = 0;
     intptr_t a, b, c;
 
     a = 0;
@@ -95,9 +96,12 @@ void fib_to_limit(size_t limit) {
         c = a + b;
         a = b;
         b = c;
-        fibs = bst_insert(fibs, sizeof(int), (int *)b, compare_int);
+        values[n++] = (int)b;
     }
 
+    // The sequence is generated in increasing order, build it in one pass
+    bst_node *fibs = bst_build_from_sorted(values, n, sizeof(int));
+
     bst_traverse_inorder(fibs, print_int);
     printf("\n");
     fflush(stdout);
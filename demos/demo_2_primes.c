@@ -85,7 +85,8 @@ int main(int argc __attribute__((unused)),
  *      Calculate prime numbers up to limit.
  */
 void primes_to_limit(size_t limit) {
-    bst_node *primes = NULL;
+    int values[MAXGEN];
+    size_t n = 0;
 
     intptr_t p = 3, c;
 
@@ -97,13 +98,16 @@ void primes_to_limit(size_t limit) {
         }
 
         if (c == p) {
-            primes = bst_insert(primes, sizeof(int), (int *)p, compare_int);
+            values[n++] = (int)p;
             count++;
         }
 
         p++;
     }
 
+    // Primes are found in increasing order, build the tree in one pass
+    bst_node *primes = bst_build_from_sorted(values, n, sizeof(int));
+
     bst_traverse_inorder(primes, print_int);
     printf("\n");
     fflush(stdout);
@@ -27,6 +27,11 @@
 
 #include <stdbool.h> // for bool type
 #include <stddef.h>  // for size_t
+#include <stdint.h>  // for uint64_t
+
+// Upper bound on the height of any AVL tree that fits in memory, an AVL
+// tree of height h holds at least fib(h + 2) - 1 nodes
+#define BST_MAX_HEIGHT 96
 
 // Enum for comparison functions
 typedef enum result { LESSER = -1, EQUAL = 0, GREATER = 1 } result;
@@ -34,20 +39,98 @@ typedef enum result { LESSER = -1, EQUAL = 0, GREATER = 1 } result;
 // Node comparison function definition
 typedef result (*comparator)(const void *, const void *);
 
-// Free function definition
+// Free function definition, releases anything an element refers to.
+// The element storage itself belongs to the node and must not be freed.
 typedef void (*free_func)(void *);
 
 // Display function definition
 typedef void (*display_func)(void *);
 
-// Binary search tree node
+// Context carrying forms of the callbacks above for the _r functions,
+// the last argument is the ctx passed along with them
+typedef result (*comparator_r)(const void *, const void *, void *);
+typedef void (*free_func_r)(void *, void *);
+typedef void (*display_func_r)(void *, void *);
+
+// Visit function definition, called with an element and a user argument
+typedef enum visit_result { VISIT_CONTINUE = 0, VISIT_STOP = 1 } visit_result;
+typedef visit_result (*visit_func)(void *, void *);
+
+// Parallel callbacks. An apply function gets an element and a user
+// argument. A fold function adds an element to an accumulator, and a
+// combine function appends the second accumulator to the first.
+typedef void (*apply_func)(void *, void *);
+typedef void (*fold_func)(void *, const void *, void *);
+typedef void (*combine_func)(void *, const void *, void *);
+
+// Stream callbacks, both get a user argument last. A write function takes
+// len bytes and returns false if it failed. A read function stores up to
+// len bytes and returns how many, 0 at the end of the stream.
+typedef bool (*write_func)(const void *, size_t, void *);
+typedef size_t (*read_func)(void *, size_t, void *);
+
+// Node allocator hooks, alloc and free are required. The optional release
+// frees every node at once so a tree can be dropped without walking it,
+// only set it when the allocator serves a single tree.
+typedef struct bst_allocator {
+    void *(*alloc)(void *, size_t);
+    void (*free)(void *, void *);
+    void (*release)(void *);
+    void *ctx;
+} bst_allocator;
+
+// Fixed size node pool, see bst_pool_allocator
+typedef struct bst_pool bst_pool;
+
+// Opaque tree handle owning its nodes, comparator and allocator
+typedef struct bst_tree bst_tree;
+
+// Compact tree, nodes live in one array linked by 32 bit indices
+typedef struct bst_compact bst_compact;
+
+// Immutable snapshot of a tree laid out for searching
+typedef struct bst_frozen bst_frozen;
+
+// Immutable snapshot of an int tree searched with vector instructions
+typedef struct bst_frozen_int bst_frozen_int;
+
+// Tree read without locks and updated by copying paths, with the
+// reader handle each reading thread registers
+typedef struct bst_rcu bst_rcu;
+typedef struct bst_rcu_reader bst_rcu_reader;
+
+// Shared table of deduplicated strings for owned string trees
+typedef struct bst_intern bst_intern;
+
+// Prefix cached string element. The first 8 bytes of the string, big
+// endian and zero padded, and its length are kept beside the pointer so
+// most comparisons finish without touching the string itself. str comes
+// first, so functions taking a char ** element also work on a bst_str.
+typedef struct bst_str {
+    const char *str;
+    uint64_t prefix;
+    size_t len;
+} bst_str;
+
+// Binary search tree node, the element is stored inline after the header
+// so a node is a single allocation of sizeof(bst_node) + element size.
+// count is the number of nodes in the subtree rooted here.
 typedef struct bst_node {
-    void *data;
     struct bst_node *left;
     struct bst_node *right;
     size_t height;
+    size_t count;
+    unsigned char data[];
 } bst_node;
 
+// External iterator, holds the path from the root to the current node so
+// it needs no parent pointers, recursion or heap memory
+typedef struct bst_iter {
+    const bst_tree *tree;
+    bst_node *path[BST_MAX_HEIGHT];
+    size_t depth;
+} bst_iter;
+
 // Type agnostic functions
 bst_node *bst_new_node(size_t, void *);
 bst_node *bst_rotate_left(bst_node *);
@@ -55,8 +138,14 @@ bst_node *bst_rotate_right(bst_node *);
 bst_node *bst_insert(bst_node *, size_t, void *, comparator);
 bst_node *bst_remove_node(bst_node *, void *, comparator, free_func);
 bst_node *bst_lookup(bst_node *, void *, comparator);
+bst_node *bst_lower_bound(bst_node *, void *, comparator);
+bst_node *bst_upper_bound(bst_node *, void *, comparator);
+bst_node *bst_floor(bst_node *, void *, comparator);
+bst_node *bst_ceil(bst_node *, void *, comparator);
 size_t bst_height(bst_node *);
 size_t bst_size(bst_node *);
+bst_node *bst_select(bst_node *, size_t);
+size_t bst_rank(bst_node *, void *, comparator);
 size_t bst_max_depth(bst_node *);
 void bst_delete_tree(bst_node *, free_func, display_func);
 bst_node *bst_min_value_node(bst_node *);
@@ -67,6 +156,133 @@ void bst_traverse_postorder(bst_node *, display_func);
 void bst_traverse_preorder(bst_node *, display_func);
 void bst_print_current_level(bst_node *, size_t, display_func);
 void bst_print_level_order(bst_node *, display_func);
+size_t bst_traverse_level_order(bst_node *, visit_func, void *);
+bst_node *bst_build_from_sorted(const void *, size_t, size_t);
+bst_node *bst_build_from_array(const void *, size_t, size_t, comparator);
+bst_node *bst_join(bst_node *, bst_node *, bst_node *);
+bst_node *bst_split(bst_node *, const void *, comparator, bst_node **,
+                    bst_node **);
+
+// Allocator aware functions, a NULL allocator means the heap
+bst_node *bst_new_node_alloc(size_t, void *, const bst_allocator *);
+bst_node *bst_insert_alloc(bst_node *, size_t, void *, comparator,
+                           const bst_allocator *);
+bst_node *bst_remove_node_alloc(bst_node *, void *, comparator, free_func,
+                                const bst_allocator *);
+void bst_delete_tree_alloc(bst_node *, free_func, display_func,
+                           const bst_allocator *);
+
+// Context carrying functions, ctx is passed to every callback
+bst_node *bst_insert_r(bst_node *, size_t, void *, comparator_r, void *);
+bst_node *bst_remove_node_r(bst_node *, void *, comparator_r, free_func_r,
+                            void *);
+bst_node *bst_lookup_r(bst_node *, void *, comparator_r, void *);
+void bst_delete_tree_r(bst_node *, free_func_r, display_func_r, void *);
+void bst_traverse_inorder_r(bst_node *, display_func_r, void *);
+void bst_traverse_postorder_r(bst_node *, display_func_r, void *);
+void bst_traverse_preorder_r(bst_node *, display_func_r, void *);
+
+// Tree handle functions, elements are passed by address and copied in
+bst_tree *bst_tree_new(size_t, comparator, free_func);
+bst_tree *bst_tree_new_alloc(size_t, comparator, free_func,
+                             const bst_allocator *);
+void bst_tree_delete(bst_tree *, display_func);
+void bst_tree_make_concurrent(bst_tree *);
+void bst_tree_read_lock(const bst_tree *);
+void bst_tree_read_unlock(const bst_tree *);
+bool bst_tree_insert(bst_tree *, const void *);
+bool bst_tree_remove(bst_tree *, const void *);
+bool bst_tree_build_from_sorted(bst_tree *, const void *, size_t);
+bool bst_tree_build_from_array(bst_tree *, const void *, size_t);
+void *bst_tree_lookup(const bst_tree *, const void *);
+void bst_lookup_batch(const bst_tree *, const void *, size_t, void **);
+size_t bst_insert_batch(bst_tree *, const void *, size_t);
+void *bst_tree_lower_bound(const bst_tree *, const void *);
+void *bst_tree_upper_bound(const bst_tree *, const void *);
+void *bst_tree_floor(const bst_tree *, const void *);
+void *bst_tree_ceil(const bst_tree *, const void *);
+void *bst_tree_select(const bst_tree *, size_t);
+size_t bst_tree_rank(const bst_tree *, const void *);
+size_t bst_range(const bst_tree *, const void *, const void *, visit_func,
+                 void *);
+size_t bst_range_count(const bst_tree *, const void *, const void *);
+size_t bst_tree_size(const bst_tree *);
+void bst_iter_init(bst_iter *, const bst_tree *);
+void *bst_iter_current(const bst_iter *);
+void *bst_iter_next(bst_iter *);
+void *bst_iter_prev(bst_iter *);
+void *bst_iter_seek(bst_iter *, const void *);
+size_t bst_tree_height(const bst_tree *);
+bst_node *bst_tree_root(const bst_tree *);
+
+// Set operations, the second tree is consumed
+bool bst_union(bst_tree *, bst_tree *);
+bool bst_intersect(bst_tree *, bst_tree *);
+bool bst_difference(bst_tree *, bst_tree *);
+
+// Parallel traversal
+void bst_parallel_for_each(const bst_tree *, apply_func, void *);
+void bst_reduce(const bst_tree *, void *, size_t, fold_func, combine_func,
+                free_func_r, void *);
+
+// Streaming export and import
+bool bst_tree_export(const bst_tree *, write_func, void *);
+bool bst_tree_import(bst_tree *, read_func, void *);
+
+// Compact tree functions
+bst_compact *bst_compact_new(size_t, comparator, free_func);
+void bst_compact_delete(bst_compact *, display_func);
+bool bst_compact_insert(bst_compact *, const void *);
+bool bst_compact_remove(bst_compact *, const void *);
+void *bst_compact_lookup(const bst_compact *, const void *);
+size_t bst_compact_size(const bst_compact *);
+size_t bst_compact_height(const bst_compact *);
+size_t bst_compact_memory(const bst_compact *);
+void bst_compact_traverse_inorder(const bst_compact *, display_func);
+
+// Frozen snapshot functions
+bst_frozen *bst_freeze(const bst_tree *);
+void bst_frozen_delete(bst_frozen *);
+size_t bst_frozen_size(const bst_frozen *);
+void *bst_frozen_lookup(const bst_frozen *, const void *);
+void *bst_frozen_floor(const bst_frozen *, const void *);
+void *bst_frozen_ceil(const bst_frozen *, const void *);
+size_t bst_frozen_range(const bst_frozen *, const void *, const void *,
+                        visit_func, void *);
+
+// Saved tree functions
+bool bst_save(const bst_tree *, const char *);
+bst_tree *bst_load(const char *, comparator, free_func);
+bst_frozen *bst_mmap_open(const char *, comparator);
+
+// Frozen int snapshot functions
+bst_frozen_int *bst_freeze_int(const bst_tree *);
+void bst_frozen_int_delete(bst_frozen_int *);
+size_t bst_frozen_int_size(const bst_frozen_int *);
+bool bst_frozen_int_contains(const bst_frozen_int *, int);
+bool bst_frozen_int_ceil(const bst_frozen_int *, int, int *);
+const char *bst_frozen_int_kernel(const bst_frozen_int *);
+bool bst_frozen_int_use_kernel(bst_frozen_int *, const char *);
+
+// RCU tree functions
+bst_rcu *bst_rcu_new(size_t, comparator, free_func);
+void bst_rcu_delete(bst_rcu *, display_func);
+bst_rcu_reader *bst_rcu_register(bst_rcu *);
+void bst_rcu_unregister(bst_rcu_reader *);
+void bst_rcu_read_lock(bst_rcu_reader *);
+void bst_rcu_read_unlock(bst_rcu_reader *);
+bst_node *bst_rcu_root(const bst_rcu *);
+void *bst_rcu_lookup(const bst_rcu *, const void *);
+size_t bst_rcu_size(const bst_rcu *);
+bool bst_rcu_insert(bst_rcu *, const void *);
+bool bst_rcu_remove(bst_rcu *, const void *);
+void bst_rcu_synchronize(bst_rcu *);
+
+// Node pool functions
+bst_pool *bst_pool_new(size_t, size_t, bool);
+void bst_pool_release(bst_pool *);
+void bst_pool_delete(bst_pool *);
+bst_allocator bst_pool_allocator(bst_pool *);
 
 // Int specific functions
 result compare_int(const void *, const void *);
@@ -77,6 +293,14 @@ void print_rm_int(void *);
 result compare_str(const void *, const void *);
 void print_str(void *);
 void print_rm_str(void *);
+bst_str bst_str_key(const char *);
+result compare_str_prefix(const void *, const void *);
+bst_tree *bst_tree_new_str(free_func);
+bst_tree *bst_tree_new_owned_str(bst_intern *);
+bst_intern *bst_intern_new(void);
+void bst_intern_delete(bst_intern *);
+const char *bst_intern_str(bst_intern *, const char *);
+size_t bst_intern_size(bst_intern *);
 
 // Error handling routines
 
@@ -0,0 +1,294 @@
+/**
+ * bst_typed.h - Typed, header only AVL trees with inlined comparisons.
+ *
+ * Copyright (c) 2024 Michael Berry
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * BST_DEFINE(name, key_type, cmp_expr) generates a tree type `name` whose
+ * nodes hold a key_type key inline, plus static inline functions with the
+ * comparison compiled in:
+ *
+ *      void name_init(name *);
+ *      void name_clear(name *);
+ *      size_t name_size(const name *);
+ *      bool name_insert(name *, key_type);
+ *      key_type *name_lookup(const name *, key_type);
+ *      bool name_remove(name *, key_type);
+ *      void name_iterate(const name *, void (*)(key_type *, void *), void *);
+ *
+ * cmp_expr is an int expression of the keys a and b, negative, zero or
+ * positive as a is less than, equal to or greater than b, for example
+ *
+ *      BST_DEFINE(int_set, int, BST_CMP_NUMERIC(a, b))
+ *
+ * name_insert returns false if an equal key is present or no node can be
+ * allocated. Nothing here needs libbst at link time, a path deeper than
+ * BST_MAX_HEIGHT, which no AVL tree that fits in memory reaches, calls
+ * BST_TYPED_PANIC.
+ */
+
+#ifndef BST_TYPED_H
+#define BST_TYPED_H
+
+#include "bst.h" // for BST_MAX_HEIGHT
+
+#include <stdbool.h> // for bool type
+#include <stddef.h>  // for size_t
+#include <stdlib.h>  // for malloc, free and abort
+
+// Called with a message when a tree outgrows its path arrays, define it
+// before including this header to report the failure another way
+#ifndef BST_TYPED_PANIC
+#define BST_TYPED_PANIC(msg) abort()
+#endif
+
+// Three way comparison of two numeric keys
+#define BST_CMP_NUMERIC(a, b) (((a) > (b)) - ((a) < (b)))
+
+#define BST_DEFINE(name, key_type, cmp_expr)                                   \
+    typedef struct name##_node {                                               \
+        struct name##_node *left;                                              \
+        struct name##_node *right;                                             \
+        size_t height;                                                         \
+        key_type key;                                                          \
+    } name##_node;                                                             \
+                                                                               \
+    typedef struct name {                                                      \
+        name##_node *root;                                                     \
+        size_t count;                                                          \
+    } name;                                                                    \
+                                                                               \
+    static inline int name##_cmp(key_type a, key_type b) {                     \
+        return (cmp_expr);                                                     \
+    }                                                                          \
+                                                                               \
+    static inline size_t name##_height(const name##_node *node) {              \
+        return node ? node->height : 0;                                        \
+    }                                                                          \
+                                                                               \
+    static inline void name##_update(name##_node *node) {                      \
+        size_t l = name##_height(node->left);                                  \
+        size_t r = name##_height(node->right);                                 \
+        node->height = (l > r ? l : r) + 1;                                    \
+    }                                                                          \
+                                                                               \
+    static inline int name##_balance(const name##_node *node) {                \
+        return (int)name##_height(node->left) -                                \
+               (int)name##_height(node->right);                                \
+    }                                                                          \
+                                                                               \
+    static inline name##_node *name##_rotate_left(name##_node *x) {            \
+        name##_node *y = x->right;                                             \
+        x->right = y->left;                                                    \
+        y->left = x;                                                           \
+        name##_update(x);                                                      \
+        name##_update(y);                                                      \
+        return y;                                                              \
+    }                                                                          \
+                                                                               \
+    static inline name##_node *name##_rotate_right(name##_node *y) {           \
+        name##_node *x = y->left;                                              \
+        y->left = x->right;                                                    \
+        x->right = y;                                                          \
+        name##_update(y);                                                      \
+        name##_update(x);                                                      \
+        return x;                                                              \
+    }                                                                          \
+                                                                               \
+    static inline name##_node *name##_rebalance(name##_node *node) {           \
+        name##_update(node);                                                   \
+        int balance = name##_balance(node);                                    \
+        if (balance > 1) {                                                     \
+            if (name##_balance(node->left) < 0) {                              \
+                node->left = name##_rotate_left(node->left);                   \
+            }                                                                  \
+            return name##_rotate_right(node);                                  \
+        }                                                                      \
+        if (balance < -1) {                                                    \
+            if (name##_balance(node->right) > 0) {                             \
+                node->right = name##_rotate_right(node->right);                \
+            }                                                                  \
+            return name##_rotate_left(node);                                   \
+        }                                                                      \
+        return node;                                                           \
+    }                                                                          \
+                                                                               \
+    static inline void name##_init(name *tree) {                               \
+        tree->root = NULL;                                                     \
+        tree->count = 0;                                                       \
+    }                                                                          \
+                                                                               \
+    static inline size_t name##_size(const name *tree) {                       \
+        return tree->count;                                                    \
+    }                                                                          \
+                                                                               \
+    static inline bool name##_insert(name *tree, key_type key) {               \
+        name##_node **path[BST_MAX_HEIGHT];                                    \
+        size_t depth = 0;                                                      \
+        name##_node **link = &tree->root;                                      \
+        name##_node *curr = tree->root;                                        \
+        while (curr) {                                                         \
+            int c = name##_cmp(key, curr->key);                                \
+            if (c == 0) {                                                      \
+                return false;                                                  \
+            }                                                                  \
+            if (depth == BST_MAX_HEIGHT) {                                     \
+                BST_TYPED_PANIC(#name "_insert: tree is too deep");            \
+            }                                                                  \
+            path[depth++] = link;                                              \
+            if (c < 0) {                                                       \
+                link = &curr->left;                                            \
+                curr = curr->left;                                             \
+            } else {                                                           \
+                link = &curr->right;                                           \
+                curr = curr->right;                                            \
+            }                                                                  \
+        }                                                                      \
+        name##_node *node = malloc(sizeof(name##_node));                       \
+        if (!node) {                                                           \
+            return false;                                                      \
+        }                                                                      \
+        node->left = node->right = NULL;                                       \
+        node->height = 1;                                                      \
+        node->key = key;                                                       \
+        *link = node;                                                          \
+        tree->count++;                                                         \
+        while (depth--) {                                                      \
+            size_t height = path[depth][0]->height;                            \
+            *path[depth] = name##_rebalance(*path[depth]);                     \
+            if (path[depth][0]->height == height) {                            \
+                break;                                                         \
+            }                                                                  \
+        }                                                                      \
+        return true;                                                           \
+    }                                                                          \
+                                                                               \
+    static inline key_type *name##_lookup(const name *tree, key_type key) {    \
+        name##_node *curr = tree->root;                                        \
+        while (curr) {                                                         \
+            int c = name##_cmp(key, curr->key);                                \
+            if (c == 0) {                                                      \
+                return &curr->key;                                             \
+            }                                                                  \
+            if (c < 0) {                                                       \
+                curr = curr->left;                                             \
+            } else {                                                           \
+                curr = curr->right;                                            \
+            }                                                                  \
+        }                                                                      \
+        return NULL;                                                           \
+    }                                                                          \
+                                                                               \
+    static inline bool name##_remove(name *tree, key_type key) {               \
+        name##_node **path[BST_MAX_HEIGHT];                                    \
+        size_t depth = 0;                                                      \
+        name##_node **link = &tree->root;                                      \
+        name##_node *curr = tree->root;                                        \
+        while (curr) {                                                         \
+            int c = name##_cmp(key, curr->key);                                \
+            if (c == 0) {                                                      \
+                break;                                                         \
+            }                                                                  \
+            if (depth == BST_MAX_HEIGHT) {                                     \
+                BST_TYPED_PANIC(#name "_remove: tree is too deep");            \
+            }                                                                  \
+            path[depth++] = link;                                              \
+            if (c < 0) {                                                       \
+                link = &curr->left;                                            \
+                curr = curr->left;                                             \
+            } else {                                                           \
+                link = &curr->right;                                           \
+                curr = curr->right;                                            \
+            }                                                                  \
+        }                                                                      \
+        if (!curr) {                                                           \
+            return false;                                                      \
+        }                                                                      \
+        if (!curr->left || !curr->right) {                                     \
+            *link = curr->left ? curr->left : curr->right;                     \
+        } else {                                                               \
+            size_t top = depth;                                                \
+            name##_node **succ_link = &curr->right;                            \
+            name##_node *succ = curr->right;                                   \
+            if (depth == BST_MAX_HEIGHT) {                                     \
+                BST_TYPED_PANIC(#name "_remove: tree is too deep");            \
+            }                                                                  \
+            path[depth++] = link;                                              \
+            while (succ->left) {                                               \
+                if (depth == BST_MAX_HEIGHT) {                                 \
+                    BST_TYPED_PANIC(#name "_remove: tree is too deep");        \
+                }                                                              \
+                path[depth++] = succ_link;                                     \
+                succ_link = &succ->left;                                       \
+                succ = succ->left;                                             \
+            }                                                                  \
+            *succ_link = succ->right;                                          \
+            succ->left = curr->left;                                           \
+            succ->right = curr->right;                                         \
+            *link = succ;                                                      \
+            if (top + 1 < depth) {                                             \
+                path[top + 1] = &succ->right;                                  \
+            }                                                                  \
+        }                                                                      \
+        while (depth--) {                                                      \
+            *path[depth] = name##_rebalance(*path[depth]);                     \
+        }                                                                      \
+        free(curr);                                                            \
+        tree->count--;                                                         \
+        return true;                                                           \
+    }                                                                          \
+                                                                               \
+    static inline void name##_iterate(const name *tree,                        \
+                                      void (*visit)(key_type *, void *),       \
+                                      void *arg) {                             \
+        name##_node *stack[BST_MAX_HEIGHT];                                    \
+        size_t depth = 0;                                                      \
+        name##_node *curr = tree->root;                                        \
+        while (curr || depth) {                                                \
+            while (curr) {                                                     \
+                stack[depth++] = curr;                                         \
+                curr = curr->left;                                             \
+            }                                                                  \
+            curr = stack[--depth];                                             \
+            visit(&curr->key, arg);                                            \
+            curr = curr->right;                                                \
+        }                                                                      \
+    }                                                                          \
+                                                                               \
+    static inline void name##_clear(name *tree) {                              \
+        name##_node *curr = tree->root;                                        \
+        while (curr) {                                                         \
+            if (curr->left) {                                                  \
+                name##_node *left = curr->left;                                \
+                curr->left = left->right;                                      \
+                left->right = curr;                                            \
+                curr = left;                                                   \
+            } else {                                                           \
+                name##_node *right = curr->right;                              \
+                free(curr);                                                    \
+                curr = right;                                                  \
+            }                                                                  \
+        }                                                                      \
+        name##_init(tree);                                                     \
+    }
+
+#endif
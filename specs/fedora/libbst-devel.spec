@@ -6,7 +6,7 @@
 
 
 Name:           libbst-devel
-Version:        0.1.2
+Version:        0.2.0
 Release:        1
 License:        MIT
 Summary:        Generically typed C library for creating self balanced binary trees
@@ -40,9 +40,18 @@ A generically typed C library for creating self balancing AVL Binary Trees.
 %defattr(-,root,root,-)
 %doc README.md
 %{_libdir}/libbst.so
+%{_libdir}/libbst.so.1*
 %{_includedir}/bst.h
+%{_includedir}/bst_typed.h
 
 %changelog
+* Sat Oct 17 2026 Michael Berry <trismegustis@gmail.com> - 0.2.0-1
+- Break the ABI, soversion is now 1
+- bst_node stores the element inline in a flexible array member data
+  and carries a subtree element count
+- A free_func now releases only what an element refers to, the element
+  storage belongs to the node, so callers must no longer pass free
+
 * Wed Aug 14 2024 Michael Berry <trismegustis@gmail.com> - 0.1.2-1
 - Rebuild
 
@@ -22,7 +22,10 @@
  * SOFTWARE.
  */
 
-#include "../include/bst.h"
+// For the writer preferring rwlock kind of glibc
+#define _GNU_SOURCE
+
+#include "bst_private.h"
 
 static const int MAXLINE = 128;
 
@@ -33,30 +36,185 @@ static const int MAXLINE = 128;
 #include <stdlib.h>
 #include <string.h>
 
-#define max(a, b) (a > b) ? a : b
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+// Number of keys walked down the tree in lockstep by the batch functions
+#define BATCH_GROUP 16
+
+// Element ordering, cmp_r is called with ctx when cmp is NULL. The test
+// is inlined at every comparison, so a context free comparator is still
+// called directly.
+typedef struct bst_order {
+    comparator cmp;
+    comparator_r cmp_r;
+    void *ctx;
+} bst_order;
+
+// Element callbacks, each _r form is called with ctx when the context
+// free one is NULL
+typedef struct bst_hooks {
+    free_func freefn;
+    display_func display;
+    free_func_r freefn_r;
+    display_func_r display_r;
+    void *ctx;
+} bst_hooks;
 
 /**
- * bst_new_node:
- *      Allocate a new bst_node on the heap and return it.
+ * bst_compare:
+ *      Compare a against b in the given order.
  */
-bst_node *bst_new_node(size_t size, void *data) {
-    bst_node *node = calloc(1, sizeof(bst_node));
-    if (!node) {
-        error_syscall("Unable to allocate memory for bst_node");
+static inline result bst_compare(const bst_order *order, const void *a,
+                                 const void *b) {
+    return order->cmp ? order->cmp(a, b) : order->cmp_r(a, b, order->ctx);
+}
+
+/**
+ * bst_display_hook, bst_free_hook:
+ *      Run the display or free callback of hooks on data, if there is one.
+ */
+static inline void bst_display_hook(const bst_hooks *hooks, void *data) {
+    if (hooks->display) {
+        hooks->display(data);
+    } else if (hooks->display_r) {
+        hooks->display_r(data, hooks->ctx);
+    }
+}
+
+static inline void bst_free_hook(const bst_hooks *hooks, void *data) {
+    if (hooks->freefn) {
+        hooks->freefn(data);
+    } else if (hooks->freefn_r) {
+        hooks->freefn_r(data, hooks->ctx);
     }
+}
+
+/**
+ * heap_alloc:
+ *      Default node allocator, plain calloc.
+ */
+static void *heap_alloc(void *ctx __attribute__((unused)), size_t size) {
+    return calloc(1, size);
+}
+
+/**
+ * heap_free:
+ *      Default node deallocator, plain free.
+ */
+static void heap_free(void *ctx __attribute__((unused)), void *ptr) {
+    free(ptr);
+}
+
+static bst_node *bst_insert_elem(bst_node **, size_t, const void *, size_t,
+                                 const bst_order *, const bst_allocator *,
+                                 bool *);
+static bst_node *bst_detach_elem(bst_node **, const void *,
+                                 const bst_order *);
+static bst_node *bst_lookup_elem(bst_node *, const void *,
+                                 const bst_order *);
+static bst_node *bst_search_ge(bst_node *, const void *, comparator, bool);
+static bst_node *bst_search_le(bst_node *, const void *, comparator, bool);
+static size_t bst_rank_elem(bst_node *, const void *, comparator, bool);
+static bst_node *bst_build_range(const unsigned char *, size_t, size_t, size_t,
+                                 const bst_allocator *);
+static size_t bst_sort_unique(unsigned char *, size_t, size_t, comparator);
+static void bst_delete_nodes(bst_node *, const bst_hooks *,
+                             const bst_allocator *);
+static void bst_walk_inorder(bst_node *, const bst_hooks *);
+static void bst_walk_postorder(bst_node *, const bst_hooks *);
+static void bst_walk_preorder(bst_node *, const bst_hooks *);
+
+static const bst_allocator heap_allocator = {heap_alloc, heap_free, NULL,
+                                             NULL};
+
+/**
+ * bst_heap_allocated:
+ *      True if alloc is the default heap allocator, which unlike a pool
+ *      may be used from several threads at once.
+ */
+bool bst_heap_allocated(const bst_allocator *alloc) {
+    return alloc->free == heap_free;
+}
 
-    if (!(node->data = calloc(1, size))) {
-        error_syscall("Unable to allocate bst_node->data");
+/**
+ * bst_alloc_node:
+ *      Allocate a node for a size byte element and copy len bytes of
+ *      elem into it, any remaining bytes are zeroed.
+ *
+ *      The node header and its element are a single allocation.
+ */
+bst_node *bst_alloc_node(size_t size, const void *elem, size_t len,
+                         const bst_allocator *alloc) {
+    bst_node *node = alloc->alloc(alloc->ctx, sizeof(bst_node) + size);
+    if (!node) {
+        error_syscall("Unable to allocate memory for bst_node");
     }
 
-    memcpy(node->data, &data, size);
+    memcpy(node->data, elem, len);
+    memset(node->data + len, 0, size - len);
     node->left = node->right = NULL;
 
     node->height = 1; // initialize as a leaf node
+    node->count = 1;
 
     return node;
 }
 
+/**
+ * bst_new_node:
+ *      Allocate a new bst_node on the heap and return it.
+ */
+bst_node *bst_new_node(size_t size, void *data) {
+    return bst_new_node_alloc(size, data, NULL);
+}
+
+/**
+ * bst_new_node_alloc:
+ *      Allocate a new bst_node from alloc and return it, a NULL alloc
+ *      means the heap.
+ */
+bst_node *bst_new_node_alloc(size_t size, void *data,
+                             const bst_allocator *alloc) {
+    // data carries the element by value, never read past it
+    size_t len = size < sizeof(data) ? size : sizeof(data);
+
+    return bst_alloc_node(size, &data, len, alloc ? alloc : &heap_allocator);
+}
+
+/**
+ * bst_free_node:
+ *      Release a node's element with freefn and return the node to alloc.
+ */
+void bst_free_node(bst_node *node, free_func freefn,
+                   const bst_allocator *alloc) {
+    if (freefn) {
+        freefn(node->data);
+    }
+    alloc->free(alloc->ctx, node);
+}
+
+/**
+ * bst_update_node:
+ *      Recompute the height and subtree size of node from its children.
+ */
+void bst_update_node(bst_node *node) {
+    node->height = max(bst_height(node->left), bst_height(node->right)) + 1;
+    node->count = bst_size(node->left) + 1 + bst_size(node->right);
+}
+
+/**
+ * bst_free_subtree:
+ *      Free every node under root one at a time, releasing elements with
+ *      freefn. Unlike bst_delete_tree_alloc this never releases a whole
+ *      pool, which may still hold nodes of other subtrees.
+ */
+void bst_free_subtree(bst_node *root, free_func freefn,
+                      const bst_allocator *alloc) {
+    bst_hooks hooks = {freefn, NULL, NULL, NULL, NULL};
+
+    bst_delete_nodes(root, &hooks, alloc);
+}
+
 /**
  * Rotate a bst to the left.
  */
@@ -68,9 +226,9 @@ bst_node *bst_rotate_left(bst_node *x) {
     y->left = x;
     x->right = t2;
 
-    // Update heights
-    x->height = max(bst_height(x->left), bst_height(x->right)) + 1;
-    y->height = max(bst_height(y->left), bst_height(y->right)) + 1;
+    // Update heights and subtree sizes
+    bst_update_node(x);
+    bst_update_node(y);
 
     return y;
 }
@@ -86,9 +244,9 @@ bst_node *bst_rotate_right(bst_node *y) {
     x->right = y;
     y->left = t2;
 
-    // Update heights
-    y->height = max(bst_height(y->left), bst_height(y->right)) + 1;
-    x->height = max(bst_height(x->left), bst_height(x->right)) + 1;
+    // Update heights and subtree sizes
+    bst_update_node(y);
+    bst_update_node(x);
 
     return x;
 }
@@ -108,159 +266,150 @@ int bst_get_balance(bst_node *root) {
 /**
  * bst_insert:
  *      Insert a bst_node with a data value into a bst.
- *
- *      Cases for normal insertion:
- *          1) If the tree is empty return a new node.
- *          2) Otherwise recur down the tree until an empty node is found
- *             and insert the new node there.
- *          3) Return unchanged node.
  */
 bst_node *bst_insert(bst_node *node, size_t size, void *data, comparator cmp) {
-    if (!node) {
-        return bst_new_node(size, data);
-    }
-
-    // Perform normal insertion
-    if (cmp(&data, node->data) == LESSER) {
-        node->left = bst_insert(node->left, size, data, cmp);
-    } else if (cmp(&data, node->data) == GREATER) {
-        node->right = bst_insert(node->right, size, data, cmp);
-    } else {
-        return node;
-    }
-
-    // Update height of ancestor node
-    node->height = max(bst_height(node->left), bst_height(node->right)) + 1;
-
-    // Get the balance factor of this ancestor node
-    int balance = bst_get_balance(node);
+    return bst_insert_alloc(node, size, data, cmp, NULL);
+}
 
-    // There are 4 cases if the bst is unbalanced
+/**
+ * bst_insert_alloc:
+ *      Insert like bst_insert, taking new nodes from alloc.
+ */
+bst_node *bst_insert_alloc(bst_node *node, size_t size, void *data,
+                           comparator cmp, const bst_allocator *alloc) {
+    bst_order order = {cmp, NULL, NULL};
+    bool inserted;
 
-    // Left Left Case
-    if (balance > 1 && cmp(&data, node->left->data) == LESSER) {
-        return bst_rotate_right(node);
-    }
+    // data carries the element by value, never read past it
+    size_t len = size < sizeof(data) ? size : sizeof(data);
+    bst_insert_elem(&node, size, &data, len, &order,
+                    alloc ? alloc : &heap_allocator, &inserted);
 
-    // Right Right Case
-    if (balance < -1 && cmp(&data, node->right->data) == GREATER) {
-        return bst_rotate_left(node);
-    }
+    return node;
+}
 
-    // Left Right Case
-    if (balance > 1 && cmp(&data, node->left->data) == GREATER) {
-        node->left = bst_rotate_left(node->left);
-        return bst_rotate_right(node);
-    }
+/**
+ * bst_insert_r:
+ *      Insert like bst_insert, ordering elements with cmp called on ctx.
+ */
+bst_node *bst_insert_r(bst_node *node, size_t size, void *data,
+                       comparator_r cmp, void *ctx) {
+    bst_order order = {NULL, cmp, ctx};
+    bool inserted;
 
-    // Right Left Case
-    if (balance < -1 && cmp(&data, node->right->data) == LESSER) {
-        node->right = bst_rotate_right(node->right);
-        return bst_rotate_left(node);
-    }
+    size_t len = size < sizeof(data) ? size : sizeof(data);
+    bst_insert_elem(&node, size, &data, len, &order, &heap_allocator,
+                    &inserted);
 
     return node;
 }
 
 /**
- * bst_remove_node:
- *      Given a bst and a data value, remove the node containing data
- *      and return the new root.
+ * bst_insert_elem:
+ *      Insert the element at elem, of which len bytes are readable, into
+ *      the tree at rootp and return the node holding it. inserted tells
+ *      whether a new node was created.
  *
- *      Step 1)
- *      Cases:
- *          1) Base case, if the root node is empty, return it.
- *          2) If the data to removed is smaller than the root,
- *             it is in the left subtree.
- *          3) If the data to be removed is greater than the root,
- *             it is in the right subtree.
- *          4) Data is equal to the root, remove this node by handling
- *             the case of a node with zero or one children, or
- *             by handling the case where the node has two children.
- *       Step 2)
- *          Update the root height.
- *       Step 3)
- *          Get the tree's balance factor.
- *       Step 4)
- *          Fix any imbalance in the tree.
+ *      Steps:
+ *          1) Walk down from the root comparing once per level, and
+ *             record each link followed and the direction taken.
+ *          2) If an equal element is found return its node unchanged.
+ *          3) Otherwise hang a new leaf off the last link.
+ *          4) Count the new element in every recorded ancestor.
+ *          5) Walk the recorded path back up updating heights. The
+ *             recorded directions pick the rotation case, and after one
+ *             rotation, or once a height stops changing, nothing above
+ *             can be out of balance.
  */
-bst_node *bst_remove_node(bst_node *root, void *data, comparator cmp,
-                          free_func freefn) {
-    bst_node *curr = root;
-    bst_node *prev = NULL;
-
-    // Find the node to be delivered, prev is it's parent
-    while (curr && cmp(curr->data, &data) != EQUAL) {
-        prev = curr;
-        if (cmp(&data, curr->data) == LESSER) {
-            curr = curr->left;
-        } else {
-            curr = curr->right;
+static bst_node *bst_insert_elem(bst_node **rootp, size_t size,
+                                 const void *elem, size_t len,
+                                 const bst_order *order,
+                                 const bst_allocator *alloc, bool *inserted) {
+    bst_node **path[BST_MAX_HEIGHT];
+    result dirs[BST_MAX_HEIGHT];
+    size_t depth = 0;
+    bst_node **link = rootp;
+    bst_node *curr = *rootp;
+
+    while (curr) {
+        result dir = bst_compare(order, elem, curr->data);
+        if (dir == EQUAL) {
+            *inserted = false;
+            return curr;
         }
-    }
 
-    if (!curr) {
-        return root;
-    }
+        if (depth == BST_MAX_HEIGHT) {
+            error_quit("bst_insert: tree is deeper than %d", BST_MAX_HEIGHT);
+        }
 
-    // Node to be removed has one child
-    if (!curr->left || !curr->right) {
-        bst_node *new_curr;
+        path[depth] = link;
+        dirs[depth++] = dir;
 
-        if (!curr->left) {
-            new_curr = curr->right;
+        // Keep this a branch, a predicted branch lets the next node be
+        // fetched while the comparison is still running
+        if (dir == LESSER) {
+            link = &curr->left;
+            curr = curr->left;
         } else {
-            new_curr = curr->left;
+            link = &curr->right;
+            curr = curr->right;
         }
+    }
 
-        // Node to be removed is root
-        if (!prev) {
-            return new_curr;
-        }
+    bst_node *node = bst_alloc_node(size, elem, len, alloc);
+    *link = node;
+    *inserted = true;
 
-        // Replace parent node's left or right child
-        if (curr == prev->left) {
-            prev->left = new_curr;
-        } else {
-            prev->right = new_curr;
-        }
+    // Every ancestor gained one element, rotations below recount locally
+    for (size_t i = 0; i < depth; i++) {
+        (*path[i])->count++;
+    }
 
-        // Free memory of node to be removed
-        if (freefn) {
-            freefn(curr->data);
-        } else {
-            free(curr->data);
-        }
-        free(curr);
-    } else {                // Node has two or more children
-        bst_node *p = NULL; // Parent node
-        bst_node *temp = NULL;
+    while (depth--) {
+        curr = *path[depth];
 
-        // Compute the inorder successor
-        temp = curr->right;
-        while (temp->left) {
-            p = temp;
-            temp = temp->left;
+        // Update height of ancestor node
+        size_t height =
+            max(bst_height(curr->left), bst_height(curr->right)) + 1;
+        if (height == curr->height) {
+            break;
         }
-
-        if (p) {
-            p->left = temp->right;
-        } else {
-            curr->right = temp->right;
+        curr->height = height;
+
+        // Get the balance factor of this ancestor node
+        int balance = bst_get_balance(curr);
+
+        // The new node is below the heavy child, its direction at that
+        // child tells the Left Left case from Left Right and so on
+        if (balance > 1) {
+            if (dirs[depth + 1] == GREATER) { // Left Right Case
+                curr->left = bst_rotate_left(curr->left);
+            }
+            *path[depth] = bst_rotate_right(curr); // Left Left Case
+            break;
         }
 
-        // Free memory of the node to be removed
-        memcpy(curr->data, temp->data, sizeof(*temp->data));
-        if (freefn) {
-            freefn(temp->data);
-        } else {
-            free(temp->data);
+        if (balance < -1) {
+            if (dirs[depth + 1] == LESSER) { // Right Left Case
+                curr->right = bst_rotate_right(curr->right);
+            }
+            *path[depth] = bst_rotate_left(curr); // Right Right Case
+            break;
         }
-        free(temp);
     }
 
-    // Update the node height
-    root->height = max(bst_height(root->left), bst_height(root->right)) + 1;
+    return node;
+}
+
+/**
+ * bst_rebalance:
+ *      Update the height and subtree size of a node whose subtrees are
+ *      balanced, fix any
+ *      imbalance at the node and return the root of the subtree.
+ */
+static bst_node *bst_rebalance(bst_node *root) {
+    // Update the node height and subtree size
+    bst_update_node(root);
 
     // Get the balance factor
     int balance = bst_get_balance(root);
@@ -291,221 +440,1571 @@ bst_node *bst_remove_node(bst_node *root, void *data, comparator cmp,
 }
 
 /**
- * bst_lookup:
- *      Search a bst for a node containing a give value.
- *
- *      Cases:
- *          1) Empty tree, return root.
- *          2) Root node is equal to data, return root.
- *          3) Recur down correct subtree.
+ * bst_remove_node:
+ *      Given a bst and a data value, remove the node containing data
+ *      and return the new root.
  */
-bst_node *bst_lookup(bst_node *root, void *data, comparator cmp) {
-    if (!root || cmp(&data, root->data) == EQUAL) {
-        return root;
-    }
-
-    if (cmp(&data, root->data) == LESSER) {
-        return bst_lookup(root->left, data, cmp);
-    }
-
-    return bst_lookup(root->right, data, cmp);
+bst_node *bst_remove_node(bst_node *root, void *data, comparator cmp,
+                          free_func freefn) {
+    return bst_remove_node_alloc(root, data, cmp, freefn, NULL);
 }
 
 /**
- * bst_height:
- *      Get the height of a tree.
+ * bst_remove_node_alloc:
+ *      Remove like bst_remove_node, returning the freed node to alloc.
  */
-size_t bst_height(bst_node *root) {
-    if (!root) {
-        return 0;
+bst_node *bst_remove_node_alloc(bst_node *root, void *data, comparator cmp,
+                                free_func freefn, const bst_allocator *alloc) {
+    bst_order order = {cmp, NULL, NULL};
+    bst_node *node = bst_detach_elem(&root, &data, &order);
+
+    if (node) {
+        bst_free_node(node, freefn, alloc ? alloc : &heap_allocator);
     }
 
-    return root->height;
+    return root;
 }
 
 /**
- * bst_size:
- *      Count the number of nodes in a tree.
+ * bst_remove_node_r:
+ *      Remove like bst_remove_node, calling cmp and freefn on ctx.
  */
-size_t bst_size(bst_node *root) {
-    if (!root) {
-        return 0;
+bst_node *bst_remove_node_r(bst_node *root, void *data, comparator_r cmp,
+                            free_func_r freefn, void *ctx) {
+    bst_order order = {NULL, cmp, ctx};
+    bst_node *node = bst_detach_elem(&root, &data, &order);
+
+    if (node) {
+        if (freefn) {
+            freefn(node->data, ctx);
+        }
+        bst_free_node(node, NULL, &heap_allocator);
     }
 
-    return (bst_size(root->left) + 1 + bst_size(root->right));
+    return root;
 }
 
 /**
- * bst_max_depth:
- *      Calculate the number of nodes along the longest path from the
- *      root node down to the farthest leaf node.
+ * bst_detach_elem:
+ *      Unlink the node matching key from the tree at rootp, rebalance
+ *      and return the node, or NULL if there is no match.
+ *
+ *      Step 1)
+ *          Walk down from the root recording each link followed.
+ *      Step 2)
+ *      Cases:
+ *          1) Key is not in the tree, nothing to do.
+ *          2) The node has zero or one children, its child takes its
+ *             place.
+ *          3) The node has two children, keep recording links down to
+ *             the inorder successor, unlink the successor and splice it
+ *             into the node's place.
+ *      Step 3)
+ *          Walk the recorded path back up, updating the height and
+ *          fixing any imbalance at every level.
  */
-size_t bst_max_depth(bst_node *root) {
-    if (!root) {
-        return 0;
-    }
+static bst_node *bst_detach_elem(bst_node **rootp, const void *key,
+                                 const bst_order *order) {
+    bst_node **path[BST_MAX_HEIGHT];
+    size_t depth = 0;
+    bst_node **link = rootp;
+    bst_node *curr = *rootp;
+
+    while (curr) {
+        result dir = bst_compare(order, key, curr->data);
+        if (dir == EQUAL) {
+            break;
+        }
 
-    size_t l_depth = bst_max_depth(root->left);
-    size_t r_depth = bst_max_depth(root->right);
+        if (depth == BST_MAX_HEIGHT) {
+            error_quit("bst_remove_node: tree is deeper than %d",
+                       BST_MAX_HEIGHT);
+        }
 
-    if (l_depth > r_depth) {
-        return l_depth + 1;
+        path[depth++] = link;
+        if (dir == LESSER) {
+            link = &curr->left;
+            curr = curr->left;
+        } else {
+            link = &curr->right;
+            curr = curr->right;
+        }
     }
 
-    return r_depth + 1;
-}
-
-/**
- * bst_delete_tree:
- *      Delete an entire bst by using postorder traversal.
- */
-void bst_delete_tree(bst_node *root, free_func freefn, display_func display) {
-    if (!root) {
-        return;
+    if (!curr) {
+        return NULL;
     }
 
-    bst_delete_tree(root->left, freefn, display);
-    bst_delete_tree(root->right, freefn, display);
-    if (display) {
-        display(root->data);
-    }
-    if (freefn) {
-        freefn(root->data);
+    if (!curr->left || !curr->right) {
+        *link = curr->left ? curr->left : curr->right;
     } else {
-        free(root->data);
-    }
-    root->data = NULL;
-    free(root);
-    root = NULL;
-}
+        size_t top = depth;
+        bst_node **succ_link = &curr->right;
+        bst_node *succ = curr->right;
+
+        // The successor ends up where curr is now
+        path[depth++] = link;
+        while (succ->left) {
+            if (depth == BST_MAX_HEIGHT) {
+                error_quit("bst_remove_node: tree is deeper than %d",
+                           BST_MAX_HEIGHT);
+            }
+
+            path[depth++] = succ_link;
+            succ_link = &succ->left;
+            succ = succ->left;
+        }
 
-/**
- * bst_min_value_node:
- *      Given a non-empty tree traverse down the left hand side of the
- *      tree and return the node with the minimum data value.
- */
-bst_node *bst_min_value_node(bst_node *root) {
-    bst_node *curr = root;
+        *succ_link = succ->right;
+        succ->left = curr->left;
+        succ->right = curr->right;
+        *link = succ;
 
-    while (curr->left) {
-        curr = curr->left;
+        // The link below the successor moved along with it
+        if (top + 1 < depth) {
+            path[top + 1] = &succ->right;
+        }
+    }
+
+    while (depth--) {
+        *path[depth] = bst_rebalance(*path[depth]);
     }
 
+    curr->left = curr->right = NULL;
+
     return curr;
 }
 
 /**
- * bst_max_value_node:
- *      Given a non-empty tree traverse down the right hand side of the
- *      tree and return the node with the maximum data value.
+ * bst_lookup:
+ *      Search a bst for a node containing a give value.
  */
-bst_node *bst_max_value_node(bst_node *root) {
-    bst_node *curr = root;
-
-    while (curr->right) {
-        curr = curr->right;
-    }
+bst_node *bst_lookup(bst_node *root, void *data, comparator cmp) {
+    bst_order order = {cmp, NULL, NULL};
 
-    return curr;
+    return bst_lookup_elem(root, &data, &order);
 }
 
 /**
- * bst_is_bst:
- *      Check that a binary tree is a bst by recursively checking
- *      the left and right constraints of each node.
+ * bst_lookup_r:
+ *      Search like bst_lookup, calling cmp on ctx.
  */
-bool bst_is_bst(bst_node *root, comparator cmp) {
-    if (!root) {
-        return true;
-    }
-
-    if (root->left &&
-        cmp(bst_max_value_node(root->left)->data, root->data) == GREATER) {
-        return false;
-    }
-
-    if (root->right &&
-        (cmp(bst_min_value_node(root->right)->data, root->data) <= EQUAL)) {
-        return false;
-    }
-
-    if (!bst_is_bst(root->left, cmp) || !bst_is_bst(root->right, cmp)) {
-        return false;
-    }
+bst_node *bst_lookup_r(bst_node *root, void *data, comparator_r cmp,
+                       void *ctx) {
+    bst_order order = {NULL, cmp, ctx};
 
-    return true;
+    return bst_lookup_elem(root, &data, &order);
 }
 
 /**
- * bst_traverse_inorder:
- *      Traverse a bst inorder and print out the data in each node.
+ * bst_lower_bound:
+ *      Find the node with the smallest value not less than data.
  */
-void bst_traverse_inorder(bst_node *node, display_func display) {
-    if (!node) {
-        return;
-    }
-
-    bst_traverse_inorder(node->left, display);
-    display(node->data);
-    bst_traverse_inorder(node->right, display);
+bst_node *bst_lower_bound(bst_node *root, void *data, comparator cmp) {
+    return bst_search_ge(root, &data, cmp, false);
 }
 
 /**
- * bst_traverse_postorder:
- *      Traverse a bst postorder and print out the data in each node.
+ * bst_upper_bound:
+ *      Find the node with the smallest value greater than data.
  */
-void bst_traverse_postorder(bst_node *node, display_func display) {
-    if (!node) {
-        return;
-    }
-
-    bst_traverse_postorder(node->left, display);
-    bst_traverse_postorder(node->right, display);
-    display(node->data);
+bst_node *bst_upper_bound(bst_node *root, void *data, comparator cmp) {
+    return bst_search_ge(root, &data, cmp, true);
 }
 
 /**
- * bst_traverse_preorder:
- *      Traverse a bst preorder and print out the data in each node.
+ * bst_floor:
+ *      Find the node with the largest value not greater than data.
  */
-void bst_traverse_preorder(bst_node *node, display_func display) {
-    if (!node) {
-        return;
-    }
-
-    display(node->data);
-    bst_traverse_preorder(node->left, display);
-    bst_traverse_preorder(node->right, display);
+bst_node *bst_floor(bst_node *root, void *data, comparator cmp) {
+    return bst_search_le(root, &data, cmp, false);
+}
+
+/**
+ * bst_ceil:
+ *      Find the node with the smallest value not less than data.
+ */
+bst_node *bst_ceil(bst_node *root, void *data, comparator cmp) {
+    return bst_search_ge(root, &data, cmp, false);
+}
+
+/**
+ * bst_lookup_elem:
+ *      Search a bst for a node matching the element at key, comparing
+ *      once per level.
+ */
+static bst_node *bst_lookup_elem(bst_node *root, const void *key,
+                                 const bst_order *order) {
+    bst_node *curr = root;
+
+    while (curr) {
+        result dir = bst_compare(order, key, curr->data);
+        if (dir == EQUAL) {
+            break;
+        }
+
+        if (dir == LESSER) {
+            curr = curr->left;
+        } else {
+            curr = curr->right;
+        }
+    }
+
+    return curr;
+}
+
+/**
+ * bst_search_ge:
+ *      Find the node with the smallest element greater than key, or
+ *      equal to it unless strict, comparing once per level.
+ *
+ *      Every node where the search turns left is a candidate, the last
+ *      one seen is the closest.
+ */
+static bst_node *bst_search_ge(bst_node *root, const void *key, comparator cmp,
+                               bool strict) {
+    bst_node *best = NULL;
+    bst_node *curr = root;
+
+    while (curr) {
+        result dir = cmp(key, curr->data);
+        if (dir == EQUAL && !strict) {
+            return curr;
+        }
+
+        if (dir == LESSER) {
+            best = curr;
+            curr = curr->left;
+        } else {
+            curr = curr->right;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * bst_search_le:
+ *      Find the node with the largest element less than key, or equal
+ *      to it unless strict, comparing once per level.
+ */
+static bst_node *bst_search_le(bst_node *root, const void *key, comparator cmp,
+                               bool strict) {
+    bst_node *best = NULL;
+    bst_node *curr = root;
+
+    while (curr) {
+        result dir = cmp(key, curr->data);
+        if (dir == EQUAL && !strict) {
+            return curr;
+        }
+
+        if (dir == GREATER) {
+            best = curr;
+            curr = curr->right;
+        } else {
+            curr = curr->left;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * bst_build_from_sorted:
+ *      Build a balanced tree on the heap from n elements of size bytes
+ *      that are already in strictly increasing order, in O(n) time and
+ *      without calling a comparator.
+ */
+bst_node *bst_build_from_sorted(const void *array, size_t n, size_t size) {
+    return bst_build_range(array, 0, n, size, &heap_allocator);
+}
+
+/**
+ * bst_build_from_array:
+ *      Build a balanced tree on the heap from n elements of size bytes in
+ *      any order. Elements are sorted first and duplicates are dropped.
+ */
+bst_node *bst_build_from_array(const void *array, size_t n, size_t size,
+                               comparator cmp) {
+    unsigned char *sorted = malloc(n * size + 1);
+    if (!sorted) {
+        error_syscall("Unable to allocate memory for sorting");
+    }
+
+    memcpy(sorted, array, n * size);
+    n = bst_sort_unique(sorted, n, size, cmp);
+
+    bst_node *root = bst_build_range(sorted, 0, n, size, &heap_allocator);
+    free(sorted);
+
+    return root;
+}
+
+/**
+ * bst_build_range:
+ *      Build a perfectly balanced subtree from elements lo up to hi of a
+ *      sorted array. The middle element becomes the root, so sibling
+ *      subtree heights differ by at most one.
+ */
+static bst_node *bst_build_range(const unsigned char *array, size_t lo,
+                                 size_t hi, size_t size,
+                                 const bst_allocator *alloc) {
+    if (lo >= hi) {
+        return NULL;
+    }
+
+    size_t mid = lo + (hi - lo) / 2;
+    bst_node *node = bst_alloc_node(size, array + mid * size, size, alloc);
+
+    node->left = bst_build_range(array, lo, mid, size, alloc);
+    node->right = bst_build_range(array, mid + 1, hi, size, alloc);
+    node->height = max(bst_height(node->left), bst_height(node->right)) + 1;
+    node->count = hi - lo;
+
+    return node;
+}
+
+/**
+ * bst_sort_unique:
+ *      Sort n elements of size bytes with a bottom up merge sort, drop
+ *      all but the first of each run of equal elements and return the
+ *      number left.
+ */
+static size_t bst_sort_unique(unsigned char *array, size_t n, size_t size,
+                              comparator cmp) {
+    unsigned char *buf = malloc(n * size + 1);
+    if (!buf) {
+        error_syscall("Unable to allocate memory for sorting");
+    }
+
+    unsigned char *src = array, *dst = buf;
+    for (size_t width = 1; width < n; width *= 2) {
+        for (size_t lo = 0; lo < n; lo += 2 * width) {
+            size_t mid = lo + width < n ? lo + width : n;
+            size_t hi = mid + width < n ? mid + width : n;
+            size_t i = lo, j = mid, k = lo;
+
+            while (i < mid && j < hi) {
+                if (cmp(src + j * size, src + i * size) == LESSER) {
+                    memcpy(dst + k++ * size, src + j++ * size, size);
+                } else {
+                    memcpy(dst + k++ * size, src + i++ * size, size);
+                }
+            }
+            memcpy(dst + k * size, src + i * size, (mid - i) * size);
+            k += mid - i;
+            memcpy(dst + k * size, src + j * size, (hi - j) * size);
+        }
+
+        unsigned char *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    if (src != array) {
+        memcpy(array, src, n * size);
+    }
+    free(buf);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!unique ||
+            cmp(array + i * size, array + (unique - 1) * size) != EQUAL) {
+            memmove(array + unique++ * size, array + i * size, size);
+        }
+    }
+
+    return unique;
+}
+
+/**
+ * bst_height:
+ *      Get the height of a tree.
+ */
+size_t bst_height(bst_node *root) {
+    if (!root) {
+        return 0;
+    }
+
+    return root->height;
+}
+
+/**
+ * bst_size:
+ *      Get the number of nodes in a tree.
+ */
+size_t bst_size(bst_node *root) {
+    if (!root) {
+        return 0;
+    }
+
+    return root->count;
+}
+
+/**
+ * bst_select:
+ *      Find the node holding the k-th smallest value, counting from 0.
+ *      Return NULL if the tree has k or fewer nodes.
+ */
+bst_node *bst_select(bst_node *root, size_t k) {
+    bst_node *curr = root;
+
+    while (curr) {
+        size_t left = bst_size(curr->left);
+
+        if (k == left) {
+            break;
+        }
+
+        if (k < left) {
+            curr = curr->left;
+        } else {
+            k -= left + 1;
+            curr = curr->right;
+        }
+    }
+
+    return curr;
+}
+
+/**
+ * bst_rank:
+ *      Count the values in a tree that are less than data.
+ */
+size_t bst_rank(bst_node *root, void *data, comparator cmp) {
+    return bst_rank_elem(root, &data, cmp, false);
+}
+
+/**
+ * bst_rank_elem:
+ *      Count the elements less than key, or equal to it if inclusive.
+ *      Every time the search turns right the node and its left subtree
+ *      are below key.
+ */
+static size_t bst_rank_elem(bst_node *root, const void *key, comparator cmp,
+                            bool inclusive) {
+    bst_node *curr = root;
+    size_t rank = 0;
+
+    while (curr) {
+        result dir = cmp(key, curr->data);
+        if (dir == EQUAL) {
+            return rank + bst_size(curr->left) + inclusive;
+        }
+
+        if (dir == LESSER) {
+            curr = curr->left;
+        } else {
+            rank += bst_size(curr->left) + 1;
+            curr = curr->right;
+        }
+    }
+
+    return rank;
+}
+
+/**
+ * bst_max_depth:
+ *      Calculate the number of nodes along the longest path from the
+ *      root node down to the farthest leaf node.
+ */
+size_t bst_max_depth(bst_node *root) {
+    if (!root) {
+        return 0;
+    }
+
+    size_t l_depth = bst_max_depth(root->left);
+    size_t r_depth = bst_max_depth(root->right);
+
+    if (l_depth > r_depth) {
+        return l_depth + 1;
+    }
+
+    return r_depth + 1;
+}
+
+/**
+ * bst_delete_tree:
+ *      Delete an entire bst, calling display on each element in order
+ *      first if given.
+ */
+void bst_delete_tree(bst_node *root, free_func freefn, display_func display) {
+    bst_delete_tree_alloc(root, freefn, display, NULL);
+}
+
+/**
+ * bst_delete_tree_r:
+ *      Delete like bst_delete_tree, calling freefn and display on ctx.
+ */
+void bst_delete_tree_r(bst_node *root, free_func_r freefn,
+                       display_func_r display, void *ctx) {
+    bst_hooks hooks = {NULL, NULL, freefn, display, ctx};
+
+    bst_delete_nodes(root, &hooks, &heap_allocator);
+}
+
+/**
+ * bst_delete_nodes:
+ *      Worker for bst_delete_tree_alloc. Rotating right at the root until
+ *      it has no left child makes it the smallest node, which can then be
+ *      freed, continuing with its right subtree. Each rotation moves a
+ *      node onto the right spine for good, so the whole tree goes in
+ *      O(n) with no recursion or extra memory, whatever its shape.
+ */
+static void bst_delete_nodes(bst_node *root, const bst_hooks *hooks,
+                             const bst_allocator *alloc) {
+    while (root) {
+        bst_node *left = root->left;
+
+        if (left) {
+            root->left = left->right;
+            left->right = root;
+            root = left;
+            continue;
+        }
+
+        bst_node *next = root->right;
+        bst_display_hook(hooks, root->data);
+        bst_free_hook(hooks, root->data);
+        bst_free_node(root, NULL, alloc);
+        root = next;
+    }
+}
+
+/**
+ * bst_delete_tree_alloc:
+ *      Delete an entire bst whose nodes came from alloc.
+ *
+ *      When no element needs to be visited and the allocator can
+ *      release everything at once the walk is skipped entirely.
+ */
+void bst_delete_tree_alloc(bst_node *root, free_func freefn,
+                           display_func display, const bst_allocator *alloc) {
+    if (!alloc) {
+        alloc = &heap_allocator;
+    }
+
+    if (!freefn && !display && alloc->release) {
+        alloc->release(alloc->ctx);
+        return;
+    }
+
+    bst_hooks hooks = {freefn, display, NULL, NULL, NULL};
+    bst_delete_nodes(root, &hooks, alloc);
+}
+
+/**
+ * bst_min_value_node:
+ *      Given a non-empty tree traverse down the left hand side of the
+ *      tree and return the node with the minimum data value.
+ */
+bst_node *bst_min_value_node(bst_node *root) {
+    bst_node *curr = root;
+
+    while (curr->left) {
+        curr = curr->left;
+    }
+
+    return curr;
+}
+
+/**
+ * bst_max_value_node:
+ *      Given a non-empty tree traverse down the right hand side of the
+ *      tree and return the node with the maximum data value.
+ */
+bst_node *bst_max_value_node(bst_node *root) {
+    bst_node *curr = root;
+
+    while (curr->right) {
+        curr = curr->right;
+    }
+
+    return curr;
+}
+
+/**
+ * bst_is_bst:
+ *      Check that a binary tree is a bst by recursively checking
+ *      the left and right constraints of each node.
+ */
+bool bst_is_bst(bst_node *root, comparator cmp) {
+    if (!root) {
+        return true;
+    }
+
+    if (root->left &&
+        cmp(bst_max_value_node(root->left)->data, root->data) == GREATER) {
+        return false;
+    }
+
+    if (root->right &&
+        (cmp(bst_min_value_node(root->right)->data, root->data) <= EQUAL)) {
+        return false;
+    }
+
+    if (!bst_is_bst(root->left, cmp) || !bst_is_bst(root->right, cmp)) {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * bst_traverse_inorder:
+ *      Traverse a bst inorder and print out the data in each node.
+ */
+void bst_traverse_inorder(bst_node *node, display_func display) {
+    bst_hooks hooks = {NULL, display, NULL, NULL, NULL};
+
+    bst_walk_inorder(node, &hooks);
+}
+
+/**
+ * bst_traverse_postorder:
+ *      Traverse a bst postorder and print out the data in each node.
+ */
+void bst_traverse_postorder(bst_node *node, display_func display) {
+    bst_hooks hooks = {NULL, display, NULL, NULL, NULL};
+
+    bst_walk_postorder(node, &hooks);
+}
+
+/**
+ * bst_traverse_preorder:
+ *      Traverse a bst preorder and print out the data in each node.
+ */
+void bst_traverse_preorder(bst_node *node, display_func display) {
+    bst_hooks hooks = {NULL, display, NULL, NULL, NULL};
+
+    bst_walk_preorder(node, &hooks);
+}
+
+/**
+ * bst_traverse_inorder_r, bst_traverse_postorder_r,
+ * bst_traverse_preorder_r:
+ *      Traverse like the functions above, calling display on ctx.
+ */
+void bst_traverse_inorder_r(bst_node *node, display_func_r display,
+                            void *ctx) {
+    bst_hooks hooks = {NULL, NULL, NULL, display, ctx};
+
+    bst_walk_inorder(node, &hooks);
+}
+
+void bst_traverse_postorder_r(bst_node *node, display_func_r display,
+                              void *ctx) {
+    bst_hooks hooks = {NULL, NULL, NULL, display, ctx};
+
+    bst_walk_postorder(node, &hooks);
+}
+
+void bst_traverse_preorder_r(bst_node *node, display_func_r display,
+                             void *ctx) {
+    bst_hooks hooks = {NULL, NULL, NULL, display, ctx};
+
+    bst_walk_preorder(node, &hooks);
+}
+
+/**
+ * bst_walk_inorder, bst_walk_postorder, bst_walk_preorder:
+ *      Recursive workers of the traversals, running the display hook.
+ */
+static void bst_walk_inorder(bst_node *node, const bst_hooks *hooks) {
+    if (!node) {
+        return;
+    }
+
+    bst_walk_inorder(node->left, hooks);
+    bst_display_hook(hooks, node->data);
+    bst_walk_inorder(node->right, hooks);
+}
+
+static void bst_walk_postorder(bst_node *node, const bst_hooks *hooks) {
+    if (!node) {
+        return;
+    }
+
+    bst_walk_postorder(node->left, hooks);
+    bst_walk_postorder(node->right, hooks);
+    bst_display_hook(hooks, node->data);
+}
+
+static void bst_walk_preorder(bst_node *node, const bst_hooks *hooks) {
+    if (!node) {
+        return;
+    }
+
+    bst_display_hook(hooks, node->data);
+    bst_walk_preorder(node->left, hooks);
+    bst_walk_preorder(node->right, hooks);
 }
 
 /**
  * bst_print_current_level:
  *      Print nodes at a current level.
  */
-void bst_print_current_level(bst_node *root, size_t level,
-                             display_func display) {
-    if (!root) {
-        return;
+void bst_print_current_level(bst_node *root, size_t level,
+                             display_func display) {
+    if (!root) {
+        return;
+    }
+
+    if (level == 1) {
+        display(root->data);
+    } else if (level > 1) {
+        bst_print_current_level(root->left, level - 1, display);
+        bst_print_current_level(root->right, level - 1, display);
+    }
+}
+
+/**
+ * bst_traverse_level_order:
+ *      Visit the elements level by level from the root, left to right
+ *      within a level, until visit returns VISIT_STOP. Return the number
+ *      of elements visited.
+ *
+ *      A FIFO queue sized from the subtree count makes this O(n).
+ */
+size_t bst_traverse_level_order(bst_node *root, visit_func visit, void *arg) {
+    size_t n = bst_size(root);
+    size_t head = 0, tail = 0;
+
+    if (!n) {
+        return 0;
+    }
+
+    bst_node **queue = malloc(n * sizeof(bst_node *));
+    if (!queue) {
+        error_syscall("Unable to allocate level order queue");
+    }
+
+    // Every node is queued once, so n slots never wrap
+    queue[tail++] = root;
+    while (head < tail) {
+        bst_node *node = queue[head++];
+
+        if (visit(node->data, arg) == VISIT_STOP) {
+            break;
+        }
+        if (node->left) {
+            queue[tail++] = node->left;
+        }
+        if (node->right) {
+            queue[tail++] = node->right;
+        }
+    }
+
+    free(queue);
+    return head;
+}
+
+/**
+ * bst_display_visit:
+ *      Adapter running a display function as a visitor.
+ */
+static visit_result bst_display_visit(void *data, void *arg) {
+    display_func display = *(display_func *)arg;
+
+    display(data);
+    return VISIT_CONTINUE;
+}
+
+/**
+ * bst_print_level_order:
+ *      Print level order of a bst.
+ */
+void bst_print_level_order(bst_node *root, display_func display) {
+    bst_traverse_level_order(root, bst_display_visit, &display);
+}
+
+// Tree handle
+
+/**
+ * bst_tree_new:
+ *      Create an empty tree of size byte elements kept in cmp order,
+ *      freefn is called on every element that leaves the tree.
+ */
+bst_tree *bst_tree_new(size_t size, comparator cmp, free_func freefn) {
+    return bst_tree_new_alloc(size, cmp, freefn, NULL);
+}
+
+/**
+ * bst_tree_new_alloc:
+ *      Create an empty tree whose nodes come from alloc, a NULL alloc
+ *      means the heap.
+ */
+bst_tree *bst_tree_new_alloc(size_t size, comparator cmp, free_func freefn,
+                             const bst_allocator *alloc) {
+    bst_tree *tree = calloc(1, sizeof(bst_tree));
+    if (!tree) {
+        error_syscall("Unable to allocate memory for bst_tree");
+    }
+
+    tree->size = size;
+    tree->cmp = cmp;
+    tree->freefn = freefn;
+    tree->alloc = alloc ? *alloc : heap_allocator;
+
+    return tree;
+}
+
+/**
+ * bst_tree_make_concurrent:
+ *      Let the tree be shared between threads. Call it before the tree is
+ *      shared; there is no way back.
+ *
+ *      Every tree function then takes an internal reader-writer lock.
+ *      Reading functions share it and run in parallel, while insert,
+ *      remove, the builds and bst_insert_batch take it exclusively. The
+ *      lock gives acquire and release ordering. Once a writer returns,
+ *      every read that starts afterwards sees all of its changes,
+ *      including the bytes of inserted elements. A read never sees a
+ *      change half done.
+ *
+ *      Waiting writers block new readers, so a steady stream of lookups
+ *      cannot starve them. The read lock is therefore not recursive. A
+ *      thread holding it, through bst_tree_read_lock or inside a bst_range
+ *      visitor, must not call other bst_tree functions.
+ *
+ *      A returned element pointer is only guaranteed valid until a writer
+ *      runs. Iterators, bst_tree_root and code that keeps returned
+ *      pointers must hold bst_tree_read_lock around their use.
+ *      bst_tree_delete must not race with other calls.
+ */
+void bst_tree_make_concurrent(bst_tree *tree) {
+    pthread_rwlockattr_t attr;
+
+    if (tree->concurrent) {
+        return;
+    }
+
+    pthread_rwlockattr_init(&attr);
+#if defined(__GLIBC__)
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    int err = pthread_rwlock_init(&tree->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    if (err) {
+        errno = err;
+        error_syscall("Unable to initialise bst_tree lock");
+    }
+
+    tree->concurrent = true;
+}
+
+/**
+ * bst_tree_read_lock:
+ *      Hold the read lock of a concurrent tree so that iterators and
+ *      element pointers stay valid. Only the bst_iter functions may be
+ *      called until bst_tree_read_unlock.
+ */
+void bst_tree_read_lock(const bst_tree *tree) { tree_read_lock(tree); }
+
+/**
+ * bst_tree_read_unlock:
+ *      Release a lock taken with bst_tree_read_lock.
+ */
+void bst_tree_read_unlock(const bst_tree *tree) { tree_unlock(tree); }
+
+/**
+ * bst_tree_delete:
+ *      Delete every element, calling display on each first if given,
+ *      and free the tree handle.
+ */
+void bst_tree_delete(bst_tree *tree, display_func display) {
+    if (!tree) {
+        return;
+    }
+
+    bst_delete_tree_alloc(tree->root, tree->freefn, display, &tree->alloc);
+    bst_arena_delete(tree->strings);
+    if (tree->concurrent) {
+        pthread_rwlock_destroy(&tree->lock);
+    }
+    free(tree);
+}
+
+/**
+ * bst_tree_own_key:
+ *      Point the bst_str in node at the tree's own copy of its string.
+ */
+static void bst_tree_own_key(bst_tree *tree, bst_node *node) {
+    bst_str *key = (bst_str *)node->data;
+
+    if (tree->intern) {
+        key->str = bst_intern_str_len(tree->intern, key->str, key->len);
+    } else {
+        key->str = bst_arena_strdup(tree->strings, key->str, key->len);
+    }
+}
+
+/**
+ * bst_tree_own_keys:
+ *      bst_tree_own_key on every node of a freshly built subtree, in
+ *      order so neighbouring keys are copied next to each other.
+ */
+static void bst_tree_own_keys(bst_tree *tree, bst_node *node) {
+    if (!node) {
+        return;
+    }
+
+    bst_tree_own_keys(tree, node->left);
+    bst_tree_own_key(tree, node);
+    bst_tree_own_keys(tree, node->right);
+}
+
+/**
+ * bst_tree_insert_locked:
+ *      bst_tree_insert with the write lock already held.
+ */
+static bool bst_tree_insert_locked(bst_tree *tree, const void *elem) {
+    bst_order order = {tree->cmp, NULL, NULL};
+    bool inserted;
+
+    bst_node *node = bst_insert_elem(&tree->root, tree->size, elem,
+                                     tree->size, &order, &tree->alloc,
+                                     &inserted);
+    if (inserted) {
+        if (tree->strings || tree->intern) {
+            bst_tree_own_key(tree, node);
+        }
+        tree->count++;
+    }
+
+    return inserted;
+}
+
+/**
+ * bst_tree_insert:
+ *      Copy the element at elem into the tree.
+ *      Return true if it was added, false if an equal element exists.
+ */
+bool bst_tree_insert(bst_tree *tree, const void *elem) {
+    tree_write_lock(tree);
+    bool inserted = bst_tree_insert_locked(tree, elem);
+    tree_unlock(tree);
+
+    return inserted;
+}
+
+/**
+ * bst_tree_remove:
+ *      Remove the element equal to key.
+ *      Return true if one was found and removed.
+ */
+bool bst_tree_remove(bst_tree *tree, const void *key) {
+    bst_order order = {tree->cmp, NULL, NULL};
+
+    tree_write_lock(tree);
+    bst_node *node = bst_detach_elem(&tree->root, key, &order);
+
+    if (node) {
+        bst_free_node(node, tree->freefn, &tree->alloc);
+        tree->count--;
     }
+    tree_unlock(tree);
 
-    if (level == 1) {
-        display(root->data);
-    } else if (level > 1) {
-        bst_print_current_level(root->left, level - 1, display);
-        bst_print_current_level(root->right, level - 1, display);
+    return node != NULL;
+}
+
+/**
+ * bst_tree_fill:
+ *      Build an empty tree from n sorted unique elements, caller names
+ *      the public function for the error message.
+ */
+static bool bst_tree_fill(bst_tree *tree, const void *array, size_t n,
+                          const char *caller) {
+    tree_write_lock(tree);
+    if (tree->root) {
+        tree_unlock(tree);
+        error_message("%s: tree is not empty", caller);
+        return false;
+    }
+
+    tree->root = bst_build_range(array, 0, n, tree->size, &tree->alloc);
+    tree->count = n;
+    if (tree->strings || tree->intern) {
+        bst_tree_own_keys(tree, tree->root);
     }
+    tree_unlock(tree);
+
+    return true;
 }
 
 /**
- * bst_print_level_order:
- *      Print level order of a bst.
+ * bst_tree_build_from_sorted:
+ *      Fill an empty tree from n elements in strictly increasing order in
+ *      O(n) time. Return false if the tree is not empty.
  */
-void bst_print_level_order(bst_node *root, display_func display) {
-    size_t h = bst_max_depth(root);
+bool bst_tree_build_from_sorted(bst_tree *tree, const void *array, size_t n) {
+    return bst_tree_fill(tree, array, n, "bst_tree_build_from_sorted");
+}
+
+/**
+ * bst_tree_build_from_array:
+ *      Fill an empty tree from n elements in any order, sorting a copy
+ *      first and dropping duplicates. Return false if the tree is not
+ *      empty.
+ */
+bool bst_tree_build_from_array(bst_tree *tree, const void *array, size_t n) {
+    unsigned char *sorted = malloc(n * tree->size + 1);
+    if (!sorted) {
+        error_syscall("Unable to allocate memory for sorting");
+    }
+
+    // Sort outside the lock, readers only wait for the build itself
+    memcpy(sorted, array, n * tree->size);
+    n = bst_sort_unique(sorted, n, tree->size, tree->cmp);
+
+    bool built = bst_tree_fill(tree, sorted, n, "bst_tree_build_from_array");
+    free(sorted);
+
+    return built;
+}
+
+/**
+ * bst_descend_group:
+ *      Walk up to BATCH_GROUP keys down the tree in lockstep. Each round
+ *      does one comparison per unfinished key and prefetches the child
+ *      it moves to, so the cache misses of the whole group overlap
+ *      instead of being taken one key at a time. found[i] is set to the
+ *      matching node or NULL.
+ */
+static void bst_descend_group(const bst_tree *tree, const unsigned char *keys,
+                              size_t m, bst_node **found) {
+    bst_node *curr[BATCH_GROUP];
+    size_t active = 0;
+
+    for (size_t i = 0; i < m; i++) {
+        curr[i] = tree->root;
+        found[i] = NULL;
+        active += curr[i] != NULL;
+    }
+
+    while (active) {
+        active = 0;
+        for (size_t i = 0; i < m; i++) {
+            bst_node *node = curr[i];
+            if (!node) {
+                continue;
+            }
+
+            result dir = tree->cmp(keys + i * tree->size, node->data);
+            if (dir == EQUAL) {
+                found[i] = node;
+                curr[i] = NULL;
+                continue;
+            }
+
+            node = (dir == LESSER) ? node->left : node->right;
+            curr[i] = node;
+            if (node) {
+                prefetch(node);
+                active++;
+            }
+        }
+    }
+}
+
+/**
+ * bst_lookup_batch:
+ *      Look up n keys stored back to back and set results[i] to the
+ *      element equal to key i, or NULL. Keys are processed in groups
+ *      walked down the tree in lockstep to hide memory latency.
+ */
+void bst_lookup_batch(const bst_tree *tree, const void *keys, size_t n,
+                      void **results) {
+    const unsigned char *key = keys;
+    bst_node *found[BATCH_GROUP];
+
+    tree_read_lock(tree);
+    for (size_t base = 0; base < n; base += BATCH_GROUP) {
+        size_t m = n - base < BATCH_GROUP ? n - base : BATCH_GROUP;
+
+        bst_descend_group(tree, key + base * tree->size, m, found);
+        for (size_t i = 0; i < m; i++) {
+            results[base + i] = found[i] ? found[i]->data : NULL;
+        }
+    }
+    tree_unlock(tree);
+}
+
+/**
+ * bst_insert_batch:
+ *      Insert n elements stored back to back and return how many were
+ *      added. Each group is first walked down in lockstep, which finds
+ *      the elements already present and pulls the paths of the new ones
+ *      into cache, then the new ones are inserted one at a time.
+ */
+size_t bst_insert_batch(bst_tree *tree, const void *elems, size_t n) {
+    const unsigned char *elem = elems;
+    bst_node *found[BATCH_GROUP];
+    size_t added = 0;
+
+    tree_write_lock(tree);
+    for (size_t base = 0; base < n; base += BATCH_GROUP) {
+        size_t m = n - base < BATCH_GROUP ? n - base : BATCH_GROUP;
+
+        bst_descend_group(tree, elem + base * tree->size, m, found);
+        for (size_t i = 0; i < m; i++) {
+            if (!found[i]) {
+                added += bst_tree_insert_locked(tree,
+                                                elem + (base + i) * tree->size);
+            }
+        }
+    }
+    tree_unlock(tree);
+
+    return added;
+}
+
+/**
+ * bst_tree_lookup:
+ *      Return the stored element equal to key, or NULL.
+ */
+void *bst_tree_lookup(const bst_tree *tree, const void *key) {
+    bst_order order = {tree->cmp, NULL, NULL};
+
+    tree_read_lock(tree);
+    bst_node *node = bst_lookup_elem(tree->root, key, &order);
+    tree_unlock(tree);
+
+    return node ? node->data : NULL;
+}
+
+/**
+ * bst_tree_lower_bound:
+ *      Return the smallest stored element not less than key, or NULL.
+ */
+void *bst_tree_lower_bound(const bst_tree *tree, const void *key) {
+    tree_read_lock(tree);
+    bst_node *node = bst_search_ge(tree->root, key, tree->cmp, false);
+    tree_unlock(tree);
+
+    return node ? node->data : NULL;
+}
+
+/**
+ * bst_tree_upper_bound:
+ *      Return the smallest stored element greater than key, or NULL.
+ */
+void *bst_tree_upper_bound(const bst_tree *tree, const void *key) {
+    tree_read_lock(tree);
+    bst_node *node = bst_search_ge(tree->root, key, tree->cmp, true);
+    tree_unlock(tree);
+
+    return node ? node->data : NULL;
+}
+
+/**
+ * bst_tree_floor:
+ *      Return the largest stored element not greater than key, or NULL.
+ */
+void *bst_tree_floor(const bst_tree *tree, const void *key) {
+    tree_read_lock(tree);
+    bst_node *node = bst_search_le(tree->root, key, tree->cmp, false);
+    tree_unlock(tree);
+
+    return node ? node->data : NULL;
+}
+
+/**
+ * bst_tree_ceil:
+ *      Return the smallest stored element not less than key, or NULL.
+ */
+void *bst_tree_ceil(const bst_tree *tree, const void *key) {
+    return bst_tree_lower_bound(tree, key);
+}
+
+/**
+ * bst_tree_select:
+ *      Return the k-th smallest stored element counting from 0, or NULL.
+ */
+void *bst_tree_select(const bst_tree *tree, size_t k) {
+    tree_read_lock(tree);
+    bst_node *node = bst_select(tree->root, k);
+    tree_unlock(tree);
+
+    return node ? node->data : NULL;
+}
+
+/**
+ * bst_tree_rank:
+ *      Count the stored elements less than key.
+ */
+size_t bst_tree_rank(const bst_tree *tree, const void *key) {
+    tree_read_lock(tree);
+    size_t rank = bst_rank_elem(tree->root, key, tree->cmp, false);
+    tree_unlock(tree);
+
+    return rank;
+}
+
+/**
+ * bst_range:
+ *      Visit the elements between lo and hi inclusive in order, a NULL
+ *      bound leaves that end open. The walk ends early when visit
+ *      returns VISIT_STOP. Return the number of elements visited.
+ *
+ *      Only the nodes at or above lo on the path to lo are stacked, so
+ *      subtrees outside the range are never entered and each visited
+ *      element costs one comparison against hi.
+ */
+size_t bst_range(const bst_tree *tree, const void *lo, const void *hi,
+                 visit_func visit, void *arg) {
+    bst_node *stack[BST_MAX_HEIGHT];
+    size_t depth = 0;
+    size_t visited = 0;
+
+    tree_read_lock(tree);
+    bst_node *curr = tree->root;
+    while (curr) {
+        if (lo && tree->cmp(lo, curr->data) == GREATER) {
+            curr = curr->right;
+        } else {
+            stack[depth++] = curr;
+            curr = curr->left;
+        }
+    }
+
+    while (depth) {
+        curr = stack[--depth];
+        if (hi && tree->cmp(curr->data, hi) == GREATER) {
+            break;
+        }
+
+        visited++;
+        if (visit(curr->data, arg) == VISIT_STOP) {
+            break;
+        }
+
+        for (curr = curr->right; curr; curr = curr->left) {
+            stack[depth++] = curr;
+        }
+    }
+    tree_unlock(tree);
+
+    return visited;
+}
+
+/**
+ * bst_range_count:
+ *      Count the elements between lo and hi inclusive in O(log n), a
+ *      NULL bound leaves that end open.
+ */
+size_t bst_range_count(const bst_tree *tree, const void *lo, const void *hi) {
+    tree_read_lock(tree);
+    size_t below = lo ? bst_rank_elem(tree->root, lo, tree->cmp, false) : 0;
+    size_t upto = hi ? bst_rank_elem(tree->root, hi, tree->cmp, true)
+                     : tree->count;
+    tree_unlock(tree);
+
+    return upto > below ? upto - below : 0;
+}
+
+/**
+ * bst_iter_init:
+ *      Set up an iterator over tree, not yet positioned on an element.
+ *      Any change to the tree invalidates its iterators.
+ */
+void bst_iter_init(bst_iter *it, const bst_tree *tree) {
+    it->tree = tree;
+    it->depth = 0;
+}
+
+/**
+ * bst_iter_push_edge:
+ *      Push node and its leftmost, or rightmost when right is set,
+ *      descendants onto the iterator path.
+ */
+static void bst_iter_push_edge(bst_iter *it, bst_node *node, bool right) {
+    while (node) {
+        it->path[it->depth++] = node;
+        node = right ? node->right : node->left;
+    }
+}
+
+/**
+ * bst_iter_current:
+ *      Return the element the iterator is on, or NULL.
+ */
+void *bst_iter_current(const bst_iter *it) {
+    return it->depth ? it->path[it->depth - 1]->data : NULL;
+}
+
+/**
+ * bst_iter_next:
+ *      Step to the next element in order and return it. An iterator
+ *      that is not positioned steps to the first element, stepping past
+ *      the last returns NULL and leaves it unpositioned.
+ *
+ *      Either descend to the leftmost node of the right subtree, or
+ *      climb until the path comes up out of a left subtree. Each edge
+ *      is crossed twice over a full walk, so a step is amortized O(1).
+ */
+void *bst_iter_next(bst_iter *it) {
+    if (!it->depth) {
+        bst_iter_push_edge(it, it->tree->root, false);
+        return bst_iter_current(it);
+    }
+
+    bst_node *curr = it->path[it->depth - 1];
+    if (curr->right) {
+        bst_iter_push_edge(it, curr->right, false);
+        return bst_iter_current(it);
+    }
+
+    while (it->depth > 1 &&
+           it->path[it->depth - 2]->right == it->path[it->depth - 1]) {
+        it->depth--;
+    }
+    it->depth--;
+
+    return bst_iter_current(it);
+}
+
+/**
+ * bst_iter_prev:
+ *      Step to the previous element in order and return it, the mirror
+ *      image of bst_iter_next.
+ */
+void *bst_iter_prev(bst_iter *it) {
+    if (!it->depth) {
+        bst_iter_push_edge(it, it->tree->root, true);
+        return bst_iter_current(it);
+    }
+
+    bst_node *curr = it->path[it->depth - 1];
+    if (curr->left) {
+        bst_iter_push_edge(it, curr->left, true);
+        return bst_iter_current(it);
+    }
+
+    while (it->depth > 1 &&
+           it->path[it->depth - 2]->left == it->path[it->depth - 1]) {
+        it->depth--;
+    }
+    it->depth--;
+
+    return bst_iter_current(it);
+}
+
+/**
+ * bst_iter_seek:
+ *      Position the iterator on the smallest element not less than key
+ *      and return it, or return NULL and leave it unpositioned.
+ *
+ *      The path to key is recorded and then cut back to the last node
+ *      where the search turned left, that node is the answer.
+ */
+void *bst_iter_seek(bst_iter *it, const void *key) {
+    bst_node *curr = it->tree->root;
+    size_t best = 0;
+
+    it->depth = 0;
+    while (curr) {
+        it->path[it->depth++] = curr;
+
+        result dir = it->tree->cmp(key, curr->data);
+        if (dir == EQUAL) {
+            best = it->depth;
+            break;
+        }
+
+        if (dir == LESSER) {
+            best = it->depth;
+            curr = curr->left;
+        } else {
+            curr = curr->right;
+        }
+    }
+    it->depth = best;
+
+    return bst_iter_current(it);
+}
+
+/**
+ * bst_tree_size:
+ *      Number of elements in the tree, kept up to date on every change.
+ */
+size_t bst_tree_size(const bst_tree *tree) {
+    tree_read_lock(tree);
+    size_t count = tree->count;
+    tree_unlock(tree);
+
+    return count;
+}
+
+/**
+ * bst_tree_height:
+ *      Height of the tree.
+ */
+size_t bst_tree_height(const bst_tree *tree) {
+    tree_read_lock(tree);
+    size_t height = bst_height(tree->root);
+    tree_unlock(tree);
+
+    return height;
+}
+
+/**
+ * bst_tree_root:
+ *      Root node of the tree, for use with the per node functions.
+ *      The tree must not be modified through it.
+ */
+bst_node *bst_tree_root(const bst_tree *tree) { return tree->root; }
+
+// Node pool allocator
+
+// Slab header, nodes follow it in the same allocation
+typedef struct bst_slab {
+    struct bst_slab *next;
+} bst_slab;
+
+// Free list link, overlays a released node
+typedef struct bst_free_slot {
+    struct bst_free_slot *next;
+} bst_free_slot;
+
+struct bst_pool {
+    size_t node_size;         // bytes per node, header plus element
+    size_t slab_nodes;        // nodes carved out of each slab
+    bst_slab *slabs;          // every slab owned by the pool
+    bst_free_slot *free_list; // nodes released by bst_remove_node
+    unsigned char *next;      // next never used node in the newest slab
+    unsigned char *end;       // end of the newest slab
+    bool single_owner;        // one tree uses the pool, it may drop it all
+};
+
+/**
+ * bst_pool_new:
+ *      Create a pool of fixed size nodes for elements of size bytes.
+ *      Nodes are carved out of slabs of slab_nodes nodes, 0 picks a
+ *      slab of roughly 64KiB. A pool may serve several trees. Only when
+ *      single_owner promises it serves just one does deleting that tree
+ *      without callbacks release every slab at once, instead of
+ *      returning its nodes one by one.
+ */
+bst_pool *bst_pool_new(size_t size, size_t slab_nodes, bool single_owner) {
+    bst_pool *pool = calloc(1, sizeof(bst_pool));
+    if (!pool) {
+        error_syscall("Unable to allocate memory for bst_pool");
+    }
+
+    // Round up so every node in a slab stays pointer aligned
+    size_t align = sizeof(void *);
+    pool->node_size = (sizeof(bst_node) + size + align - 1) & ~(align - 1);
+
+    if (!slab_nodes) {
+        slab_nodes = 65536 / pool->node_size;
+    }
+    pool->slab_nodes = slab_nodes ? slab_nodes : 1;
+    pool->single_owner = single_owner;
+
+    return pool;
+}
+
+/**
+ * bst_pool_release:
+ *      Free every slab at once, all nodes taken from the pool become
+ *      invalid.
+ */
+void bst_pool_release(bst_pool *pool) {
+    bst_slab *slab = pool->slabs;
+
+    while (slab) {
+        bst_slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->next = pool->end = NULL;
+}
 
-    for (size_t i = 1; i <= h; i++) {
-        bst_print_current_level(root, i, display);
+/**
+ * bst_pool_delete:
+ *      Release all slabs and free the pool itself.
+ */
+void bst_pool_delete(bst_pool *pool) {
+    if (!pool) {
+        return;
+    }
+
+    bst_pool_release(pool);
+    free(pool);
+}
+
+/**
+ * bst_pool_alloc:
+ *      Hand out a node, recycled nodes first, then the current slab,
+ *      then a fresh slab.
+ */
+static void *bst_pool_alloc(void *ctx, size_t size) {
+    bst_pool *pool = ctx;
+
+    if (size > pool->node_size) {
+        error_quit("bst_pool: %zu byte node does not fit a %zu byte slot",
+                   size, pool->node_size);
+    }
+
+    if (pool->free_list) {
+        bst_free_slot *slot = pool->free_list;
+        pool->free_list = slot->next;
+        return slot;
+    }
+
+    if (pool->next == pool->end) {
+        bst_slab *slab =
+            malloc(sizeof(bst_slab) + pool->node_size * pool->slab_nodes);
+        if (!slab) {
+            return NULL;
+        }
+
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->next = (unsigned char *)(slab + 1);
+        pool->end = pool->next + pool->node_size * pool->slab_nodes;
     }
+
+    void *node = pool->next;
+    pool->next += pool->node_size;
+
+    return node;
+}
+
+/**
+ * bst_pool_free:
+ *      Push a node onto the pool's free list for reuse.
+ */
+static void bst_pool_free(void *ctx, void *ptr) {
+    bst_pool *pool = ctx;
+    bst_free_slot *slot = ptr;
+
+    slot->next = pool->free_list;
+    pool->free_list = slot;
+}
+
+/**
+ * bst_pool_release_all:
+ *      Allocator hook for bst_pool_release.
+ */
+static void bst_pool_release_all(void *ctx) { bst_pool_release(ctx); }
+
+/**
+ * bst_pool_allocator:
+ *      Get an allocator that takes nodes from pool. Only a single owner
+ *      pool gets the release hook, a shared one frees node by node.
+ */
+bst_allocator bst_pool_allocator(bst_pool *pool) {
+    bst_allocator alloc = {bst_pool_alloc, bst_pool_free,
+                           pool->single_owner ? bst_pool_release_all : NULL,
+                           pool};
+    return alloc;
 }
 
 /**
@@ -536,16 +2035,9 @@ void print_rm_int(void *data) { printf("Removing value: %d\n", *(int *)data); }
  *      Result is LESSER for a < b, EQUAL for a == b, GREATER for a > b
  */
 result compare_str(const void *a, const void *b) {
-    const char *ca = *(const char **)a;
-    const char *cb = *(const char **)b;
-
-    if (strcmp(ca, cb) < 0) {
-        return LESSER;
-    } else if (strcmp(ca, cb) > 0) {
-        return GREATER;
-    }
+    int diff = strcmp(*(const char **)a, *(const char **)b);
 
-    return EQUAL;
+    return (diff > 0) - (diff < 0);
 }
 
 /**
@@ -562,6 +2054,86 @@ void print_rm_str(void *data) {
     printf("Removing value: %s\n", *(char **)data);
 }
 
+/**
+ * bst_str_key:
+ *      Make the prefix cached element for str, which is referenced and
+ *      not copied.
+ */
+bst_str bst_str_key(const char *str) {
+    bst_str key = {str, 0, 0};
+    size_t i = 0;
+
+    for (; i < sizeof(key.prefix) && str[i]; i++) {
+        key.prefix = key.prefix << 8 | (unsigned char)str[i];
+    }
+    if (i && i < sizeof(key.prefix)) {
+        key.prefix <<= 8 * (sizeof(key.prefix) - i); // pad with zeros
+    }
+    key.len = i == sizeof(key.prefix) ? i + strlen(str + i) : i;
+
+    return key;
+}
+
+/**
+ * compare_str_prefix:
+ *      Compare two bst_str elements in strcmp order.
+ *
+ *      Comparing prefixes as integers orders the first 8 bytes like
+ *      memcmp. When they tie and either string ends within them, the
+ *      shorter one is a prefix of the other. Only longer strings that
+ *      share all 8 bytes go on to memcmp the rest.
+ */
+result compare_str_prefix(const void *a, const void *b) {
+    const bst_str *sa = a;
+    const bst_str *sb = b;
+
+    if (sa->prefix != sb->prefix) {
+        return sa->prefix < sb->prefix ? LESSER : GREATER;
+    }
+
+    size_t len = sa->len < sb->len ? sa->len : sb->len;
+    if (len > sizeof(sa->prefix)) {
+        int diff = memcmp(sa->str + sizeof(sa->prefix),
+                          sb->str + sizeof(sb->prefix),
+                          len - sizeof(sa->prefix));
+        if (diff) {
+            return diff < 0 ? LESSER : GREATER;
+        }
+    }
+
+    return (sa->len > sb->len) - (sa->len < sb->len);
+}
+
+/**
+ * bst_tree_new_str:
+ *      Create an empty tree of bst_str elements made with bst_str_key.
+ *      Strings are not copied, freefn gets the bst_str of each element
+ *      leaving the tree and may release its string.
+ */
+bst_tree *bst_tree_new_str(free_func freefn) {
+    return bst_tree_new(sizeof(bst_str), compare_str_prefix, freefn);
+}
+
+/**
+ * bst_tree_new_owned_str:
+ *      Create an empty tree of bst_str elements that copies the string of
+ *      every element it takes in. Copies go into an arena of the tree,
+ *      or through intern when given, which must outlive the tree. Strings
+ *      of removed elements stay until the tree is deleted, when the
+ *      arena is freed in one go.
+ */
+bst_tree *bst_tree_new_owned_str(bst_intern *intern) {
+    bst_tree *tree = bst_tree_new_str(NULL);
+
+    if (intern) {
+        tree->intern = intern;
+    } else {
+        tree->strings = bst_arena_new();
+    }
+
+    return tree;
+}
+
 // Error handling routines
 
 /**
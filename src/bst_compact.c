@@ -0,0 +1,458 @@
+/**
+ * bst_compact.c - AVL trees with nodes packed into one growable array.
+ *
+ * Copyright (c) 2024 Michael Berry
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "../include/bst.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Nodes are records in one array, addressed by 32 bit index. A record is
+// the element followed by the left and right child indices and an 8 bit
+// height. Index 0 is a sentinel with height 0 standing in for NULL, so an
+// int keyed record is 16 bytes and four fit in a cache line.
+
+#define NIL 0
+#define INITIAL_CAPACITY 16
+
+struct bst_compact {
+    unsigned char *nodes; // record array, record 0 is the sentinel
+    size_t size;          // element size in bytes
+    size_t stride;        // bytes per record
+    size_t links;         // offset of the child indices in a record
+    size_t count;         // number of elements
+    uint32_t root;        // index of the root record
+    uint32_t used;        // records handed out, including the sentinel
+    uint32_t capacity;    // records allocated
+    uint32_t free_list;   // released records, chained through left
+    comparator cmp;       // element ordering
+    free_func freefn;     // releases what an element refers to, may be NULL
+};
+
+/**
+ * record:
+ *      Address of record i.
+ */
+static inline unsigned char *record(const bst_compact *c, uint32_t i) {
+    return c->nodes + (size_t)i * c->stride;
+}
+
+/**
+ * left, right, height:
+ *      Fields of record i.
+ */
+static inline uint32_t *left(const bst_compact *c, uint32_t i) {
+    return (uint32_t *)(record(c, i) + c->links);
+}
+
+static inline uint32_t *right(const bst_compact *c, uint32_t i) {
+    return (uint32_t *)(record(c, i) + c->links) + 1;
+}
+
+static inline int8_t *height(const bst_compact *c, uint32_t i) {
+    return (int8_t *)(record(c, i) + c->links + 2 * sizeof(uint32_t));
+}
+
+/**
+ * update:
+ *      Recompute the height of record i from its children.
+ */
+static inline void update(const bst_compact *c, uint32_t i) {
+    int8_t l = *height(c, *left(c, i));
+    int8_t r = *height(c, *right(c, i));
+
+    *height(c, i) = (l > r ? l : r) + 1;
+}
+
+/**
+ * balance:
+ *      Balance factor of record i.
+ */
+static inline int balance(const bst_compact *c, uint32_t i) {
+    return *height(c, *left(c, i)) - *height(c, *right(c, i));
+}
+
+/**
+ * rotate_left:
+ *      Rotate the subtree at x to the left and return its new root.
+ */
+static uint32_t rotate_left(const bst_compact *c, uint32_t x) {
+    uint32_t y = *right(c, x);
+
+    *right(c, x) = *left(c, y);
+    *left(c, y) = x;
+    update(c, x);
+    update(c, y);
+
+    return y;
+}
+
+/**
+ * rotate_right:
+ *      Rotate the subtree at y to the right and return its new root.
+ */
+static uint32_t rotate_right(const bst_compact *c, uint32_t y) {
+    uint32_t x = *left(c, y);
+
+    *left(c, y) = *right(c, x);
+    *right(c, x) = y;
+    update(c, y);
+    update(c, x);
+
+    return x;
+}
+
+/**
+ * rebalance:
+ *      Update the height of record i, fix any imbalance there and return
+ *      the root of the subtree.
+ */
+static uint32_t rebalance(const bst_compact *c, uint32_t i) {
+    update(c, i);
+
+    int b = balance(c, i);
+    if (b > 1) {
+        if (balance(c, *left(c, i)) < 0) {
+            *left(c, i) = rotate_left(c, *left(c, i));
+        }
+        return rotate_right(c, i);
+    }
+
+    if (b < -1) {
+        if (balance(c, *right(c, i)) > 0) {
+            *right(c, i) = rotate_right(c, *right(c, i));
+        }
+        return rotate_left(c, i);
+    }
+
+    return i;
+}
+
+/**
+ * reserve:
+ *      Make sure a record can be handed out without moving the array,
+ *      so pointers into it stay valid for the rest of an insert.
+ */
+static void reserve(bst_compact *c) {
+    if (c->free_list != NIL || c->used < c->capacity) {
+        return;
+    }
+
+    if (c->capacity >= UINT32_MAX / 2) {
+        error_quit("bst_compact: too many elements for 32 bit indices");
+    }
+
+    uint32_t capacity = c->capacity * 2;
+    unsigned char *nodes = realloc(c->nodes, (size_t)capacity * c->stride);
+    if (!nodes) {
+        error_syscall("Unable to grow bst_compact");
+    }
+
+    c->nodes = nodes;
+    c->capacity = capacity;
+}
+
+/**
+ * take_record:
+ *      Hand out a reserved record holding a copy of elem.
+ */
+static uint32_t take_record(bst_compact *c, const void *elem) {
+    uint32_t i;
+
+    if (c->free_list != NIL) {
+        i = c->free_list;
+        c->free_list = *left(c, i);
+    } else {
+        i = c->used++;
+    }
+
+    memcpy(record(c, i), elem, c->size);
+    *left(c, i) = *right(c, i) = NIL;
+    *height(c, i) = 1;
+
+    return i;
+}
+
+/**
+ * bst_compact_new:
+ *      Create an empty compact tree of size byte elements kept in cmp
+ *      order, freefn is called on every element that leaves the tree.
+ */
+bst_compact *bst_compact_new(size_t size, comparator cmp, free_func freefn) {
+    bst_compact *c = calloc(1, sizeof(bst_compact));
+    if (!c) {
+        error_syscall("Unable to allocate memory for bst_compact");
+    }
+
+    // Keep the child indices 4 byte aligned and the element aligned to
+    // its size, up to 8 bytes
+    size_t align = (size % 8 == 0) ? 8 : 4;
+    c->size = size;
+    c->links = (size + 3) & ~(size_t)3;
+    c->stride = c->links + 2 * sizeof(uint32_t) + 1;
+    c->stride = (c->stride + align - 1) & ~(align - 1);
+    c->cmp = cmp;
+    c->freefn = freefn;
+    c->capacity = INITIAL_CAPACITY;
+    c->used = 1;
+
+    c->nodes = calloc(c->capacity, c->stride);
+    if (!c->nodes) {
+        error_syscall("Unable to allocate memory for bst_compact");
+    }
+
+    return c;
+}
+
+/**
+ * bst_compact_delete:
+ *      Delete every element, calling display on each first if given, and
+ *      free the tree. The records are released in one free.
+ */
+void bst_compact_delete(bst_compact *c, display_func display) {
+    if (!c) {
+        return;
+    }
+
+    if (display || c->freefn) {
+        // Free records are chained through left, mark them so they are
+        // skipped, the sentinel keeps height 0 as well
+        for (uint32_t i = c->free_list; i != NIL; i = *left(c, i)) {
+            *height(c, i) = 0;
+        }
+
+        for (uint32_t i = 1; i < c->used; i++) {
+            if (*height(c, i)) {
+                if (display) {
+                    display(record(c, i));
+                }
+                if (c->freefn) {
+                    c->freefn(record(c, i));
+                }
+            }
+        }
+    }
+
+    free(c->nodes);
+    free(c);
+}
+
+/**
+ * push_link:
+ *      Record a link on the path of an insert or remove, quitting with
+ *      the name of the caller if the path outgrows BST_MAX_HEIGHT.
+ */
+static inline void push_link(uint32_t **path, size_t *depth, uint32_t *link,
+                             const char *caller) {
+    if (*depth == BST_MAX_HEIGHT) {
+        error_quit("%s: tree is deeper than %d", caller, BST_MAX_HEIGHT);
+    }
+
+    path[(*depth)++] = link;
+}
+
+/**
+ * bst_compact_insert:
+ *      Copy the element at elem into the tree.
+ *      Return true if it was added, false if an equal element exists.
+ *
+ *      The walk down records each link followed, the walk back up
+ *      rebalances and stops once a subtree height is unchanged.
+ */
+bool bst_compact_insert(bst_compact *c, const void *elem) {
+    uint32_t *path[BST_MAX_HEIGHT];
+    size_t depth = 0;
+
+    reserve(c);
+
+    uint32_t *link = &c->root;
+    uint32_t curr = c->root;
+    while (curr != NIL) {
+        result dir = c->cmp(elem, record(c, curr));
+        if (dir == EQUAL) {
+            return false;
+        }
+
+        push_link(path, &depth, link, "bst_compact_insert");
+        if (dir == LESSER) {
+            link = left(c, curr);
+        } else {
+            link = right(c, curr);
+        }
+        curr = *link;
+    }
+
+    *link = take_record(c, elem);
+    c->count++;
+
+    while (depth--) {
+        int8_t before = *height(c, *path[depth]);
+
+        *path[depth] = rebalance(c, *path[depth]);
+        if (*height(c, *path[depth]) == before) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * bst_compact_remove:
+ *      Remove the element equal to key.
+ *      Return true if one was found and removed.
+ *
+ *      Same scheme as bst_remove_node, the inorder successor record is
+ *      spliced into the removed record's place and every level of the
+ *      recorded path is rebalanced.
+ */
+bool bst_compact_remove(bst_compact *c, const void *key) {
+    uint32_t *path[BST_MAX_HEIGHT];
+    size_t depth = 0;
+    uint32_t *link = &c->root;
+    uint32_t curr = c->root;
+
+    while (curr != NIL) {
+        result dir = c->cmp(key, record(c, curr));
+        if (dir == EQUAL) {
+            break;
+        }
+
+        push_link(path, &depth, link, "bst_compact_remove");
+        if (dir == LESSER) {
+            link = left(c, curr);
+        } else {
+            link = right(c, curr);
+        }
+        curr = *link;
+    }
+
+    if (curr == NIL) {
+        return false;
+    }
+
+    if (*left(c, curr) == NIL || *right(c, curr) == NIL) {
+        *link = (*left(c, curr) != NIL) ? *left(c, curr) : *right(c, curr);
+    } else {
+        size_t top = depth;
+        uint32_t *succ_link = right(c, curr);
+        uint32_t succ = *succ_link;
+
+        push_link(path, &depth, link, "bst_compact_remove");
+        while (*left(c, succ) != NIL) {
+            push_link(path, &depth, succ_link, "bst_compact_remove");
+            succ_link = left(c, succ);
+            succ = *succ_link;
+        }
+
+        *succ_link = *right(c, succ);
+        *left(c, succ) = *left(c, curr);
+        *right(c, succ) = *right(c, curr);
+        *link = succ;
+
+        if (top + 1 < depth) {
+            path[top + 1] = right(c, succ);
+        }
+    }
+
+    while (depth--) {
+        *path[depth] = rebalance(c, *path[depth]);
+    }
+
+    if (c->freefn) {
+        c->freefn(record(c, curr));
+    }
+    *left(c, curr) = c->free_list;
+    c->free_list = curr;
+    c->count--;
+
+    return true;
+}
+
+/**
+ * bst_compact_lookup:
+ *      Return the stored element equal to key, or NULL. The pointer is
+ *      valid until the next insert.
+ */
+void *bst_compact_lookup(const bst_compact *c, const void *key) {
+    uint32_t curr = c->root;
+
+    while (curr != NIL) {
+        result dir = c->cmp(key, record(c, curr));
+        if (dir == EQUAL) {
+            return record(c, curr);
+        }
+
+        if (dir == LESSER) {
+            curr = *left(c, curr);
+        } else {
+            curr = *right(c, curr);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * bst_compact_size:
+ *      Number of elements in the tree.
+ */
+size_t bst_compact_size(const bst_compact *c) { return c->count; }
+
+/**
+ * bst_compact_height:
+ *      Height of the tree.
+ */
+size_t bst_compact_height(const bst_compact *c) {
+    return (size_t)*height(c, c->root);
+}
+
+/**
+ * bst_compact_memory:
+ *      Bytes of record storage currently allocated.
+ */
+size_t bst_compact_memory(const bst_compact *c) {
+    return (size_t)c->capacity * c->stride;
+}
+
+/**
+ * bst_compact_traverse_inorder:
+ *      Traverse the tree in order and display each element.
+ */
+void bst_compact_traverse_inorder(const bst_compact *c, display_func display) {
+    uint32_t stack[BST_MAX_HEIGHT];
+    size_t depth = 0;
+    uint32_t curr = c->root;
+
+    while (curr != NIL || depth) {
+        while (curr != NIL) {
+            stack[depth++] = curr;
+            curr = *left(c, curr);
+        }
+
+        curr = stack[--depth];
+        display(record(c, curr));
+        curr = *right(c, curr);
+    }
+}
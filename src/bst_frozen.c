@@ -0,0 +1,490 @@
+/**
+ * bst_frozen.c - Immutable Eytzinger ordered snapshots, in memory or on disk.
+ *
+ * Copyright (c) 2024 Michael Berry
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bst_private.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A snapshot stores the elements in breadth first order of a complete
+// binary tree, element k has children 2k and 2k + 1 and slot 0 is unused.
+// The top levels share a few cache lines and a search only computes the
+// next index, so the descent has no data dependent branches and the
+// element several levels down can be prefetched while comparing.
+
+// The same layout is what bst_save writes after a fixed header, so a
+// file can be mapped and searched in place with no pointers to fix up.
+
+#define BST_FILE_MAGIC "libbst\0\0"
+#define BST_FILE_VERSION 1
+#define BST_FILE_ORDER 0x01020304u // reads back swapped on other endians
+
+struct bst_frozen {
+    unsigned char *elems; // cache line aligned, element k at k * size
+    size_t size;          // element size in bytes
+    size_t count;         // number of elements
+    unsigned ahead;       // levels below k prefetched during a search
+    comparator cmp;       // element ordering
+    void *map;            // file mapping holding elems, NULL on the heap
+    size_t map_len;       // length of the mapping
+};
+
+// On disk header, followed by the elements starting with the unused slot
+typedef struct bst_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t order;
+    uint64_t size;  // element size in bytes
+    uint64_t count; // number of elements
+    uint64_t elems; // file offset of slot 0
+    unsigned char pad[CACHE_LINE - 40];
+} bst_file_header;
+
+/**
+ * elem:
+ *      Address of element k.
+ */
+static inline void *elem(const bst_frozen *f, size_t k) {
+    return f->elems + k * f->size;
+}
+
+/**
+ * trailing_ones:
+ *      Number of low order one bits in k.
+ */
+static inline unsigned trailing_ones(size_t k) {
+#if defined(__GNUC__)
+    return ~k ? (unsigned)__builtin_ctzll(~(unsigned long long)k) : 64;
+#else
+    unsigned n = 0;
+    while (k & 1) {
+        k >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/**
+ * first:
+ *      Index of the smallest element, 0 when empty.
+ */
+static size_t first(const bst_frozen *f) {
+    size_t k = f->count ? 1 : 0;
+
+    while (2 * k <= f->count && k) {
+        k *= 2;
+    }
+
+    return k;
+}
+
+/**
+ * successor:
+ *      Index of the element after k in order, 0 past the end.
+ */
+static size_t successor(const bst_frozen *f, size_t k) {
+    if (2 * k + 1 <= f->count) {
+        k = 2 * k + 1;
+        while (2 * k <= f->count) {
+            k *= 2;
+        }
+        return k;
+    }
+
+    // Climb while k is a right child, then once more
+    return k >> (trailing_ones(k) + 1);
+}
+
+/**
+ * prefetch_levels:
+ *      Levels below a node whose elements still share a cache line with
+ *      its first descendant, capped at four.
+ */
+static unsigned prefetch_levels(size_t size) {
+    unsigned ahead = 0;
+
+    while (ahead < 4 && (2u << ahead) * size <= CACHE_LINE) {
+        ahead++;
+    }
+
+    return ahead;
+}
+
+/**
+ * search_ge:
+ *      Index of the first element not less than key, 0 if none.
+ *
+ *      Descend to a leaf going right past every smaller element, the
+ *      answer is the last node where the descent went left. Dropping the
+ *      trailing right turns and that left turn from k recovers it.
+ */
+static size_t search_ge(const bst_frozen *f, const void *key) {
+    size_t k = 1;
+
+    while (k <= f->count) {
+        prefetch(f->elems + (k << f->ahead) * f->size);
+        k = 2 * k + (f->cmp(elem(f, k), key) == LESSER);
+    }
+
+    return k >> (trailing_ones(k) + 1);
+}
+
+/**
+ * search_le:
+ *      Index of the last element not greater than key, 0 if none.
+ *
+ *      Mirror of search_ge, the answer is the last right turn.
+ */
+static size_t search_le(const bst_frozen *f, const void *key) {
+    size_t k = 1;
+
+    while (k <= f->count) {
+        prefetch(f->elems + (k << f->ahead) * f->size);
+        k = 2 * k + (f->cmp(elem(f, k), key) != GREATER);
+    }
+
+    return k >> (trailing_ones(~k) + 1);
+}
+
+/**
+ * bst_freeze:
+ *      Copy the elements of tree into a new immutable snapshot. The
+ *      snapshot does not refer to the tree, which may change or be
+ *      deleted afterwards, but elements are copied byte for byte so
+ *      anything they point to must outlive the snapshot. A concurrent
+ *      tree stays read locked while it is copied.
+ */
+bst_frozen *bst_freeze(const bst_tree *tree) {
+    bst_frozen *f = calloc(1, sizeof(bst_frozen));
+    if (!f) {
+        error_syscall("Unable to allocate memory for bst_frozen");
+    }
+
+    tree_read_lock(tree);
+
+    f->size = tree->size;
+    f->count = tree->count;
+    f->cmp = tree->cmp;
+    f->ahead = prefetch_levels(f->size);
+
+    size_t bytes = (f->count + 1) * f->size;
+    bytes = (bytes + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    if (posix_memalign((void **)&f->elems, CACHE_LINE, bytes)) {
+        error_syscall("Unable to allocate memory for bst_frozen");
+    }
+
+    // Visiting the slots in order while walking the tree in order puts
+    // every element in its breadth first position
+    bst_iter it;
+    const void *data;
+    size_t k = first(f);
+
+    bst_iter_init(&it, tree);
+    while ((data = bst_iter_next(&it))) {
+        memcpy(elem(f, k), data, f->size);
+        k = successor(f, k);
+    }
+
+    tree_unlock(tree);
+
+    return f;
+}
+
+/**
+ * bst_frozen_delete:
+ *      Free a snapshot.
+ */
+void bst_frozen_delete(bst_frozen *f) {
+    if (!f) {
+        return;
+    }
+
+    if (f->map) {
+        munmap(f->map, f->map_len);
+    } else {
+        free(f->elems);
+    }
+    free(f);
+}
+
+/**
+ * bst_frozen_size:
+ *      Number of elements in the snapshot.
+ */
+size_t bst_frozen_size(const bst_frozen *f) { return f->count; }
+
+/**
+ * bst_frozen_lookup:
+ *      Return the element equal to key, or NULL.
+ */
+void *bst_frozen_lookup(const bst_frozen *f, const void *key) {
+    size_t k = search_ge(f, key);
+
+    return (k && f->cmp(elem(f, k), key) == EQUAL) ? elem(f, k) : NULL;
+}
+
+/**
+ * bst_frozen_floor:
+ *      Return the largest element not greater than key, or NULL.
+ */
+void *bst_frozen_floor(const bst_frozen *f, const void *key) {
+    size_t k = search_le(f, key);
+
+    return k ? elem(f, k) : NULL;
+}
+
+/**
+ * bst_frozen_ceil:
+ *      Return the smallest element not less than key, or NULL.
+ */
+void *bst_frozen_ceil(const bst_frozen *f, const void *key) {
+    size_t k = search_ge(f, key);
+
+    return k ? elem(f, k) : NULL;
+}
+
+/**
+ * bst_frozen_range:
+ *      Visit the elements between lo and hi inclusive in order, NULL
+ *      bounds are open. Stops early when visit returns VISIT_STOP.
+ *      Return the number of elements visited.
+ */
+size_t bst_frozen_range(const bst_frozen *f, const void *lo, const void *hi,
+                        visit_func visit, void *arg) {
+    size_t visited = 0;
+    size_t k = lo ? search_ge(f, lo) : first(f);
+
+    while (k && (!hi || f->cmp(elem(f, k), hi) != GREATER)) {
+        visited++;
+        if (visit(elem(f, k), arg) == VISIT_STOP) {
+            break;
+        }
+        k = successor(f, k);
+    }
+
+    return visited;
+}
+
+/**
+ * bst_save:
+ *      Write the elements of tree to path in the snapshot layout so the
+ *      file can later be reopened with bst_load or bst_mmap_open. The
+ *      file is written beside path and renamed over it once complete, so
+ *      readers never see a partial file. Elements are stored byte for
+ *      byte, only trees of flat elements without pointers can be saved,
+ *      and trees owning their string keys are refused. A concurrent tree
+ *      stays read locked while it is copied. Return false if the file
+ *      cannot be written.
+ */
+bool bst_save(const bst_tree *tree, const char *path) {
+    if (tree->strings || tree->intern) {
+        error_message("bst_save: tree owns its string keys");
+        return false;
+    }
+
+    size_t path_len = strlen(path);
+    char *tmp = malloc(path_len + sizeof(".tmp"));
+    if (!tmp) {
+        error_syscall("Unable to allocate memory for bst_save");
+    }
+    memcpy(tmp, path, path_len);
+    memcpy(tmp + path_len, ".tmp", sizeof(".tmp"));
+
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        error_return("bst_save: unable to create %s", tmp);
+        free(tmp);
+        return false;
+    }
+
+    // The count sizing the file must match the elements written
+    tree_read_lock(tree);
+
+    size_t size = tree->size;
+    size_t count = tree->count;
+    size_t len = sizeof(bst_file_header) + (count + 1) * size;
+
+    // Fill the file through a shared mapping so the snapshot is never
+    // held in memory on top of the tree
+    unsigned char *map = MAP_FAILED;
+    if (ftruncate(fd, (off_t)len) == 0) {
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        tree_unlock(tree);
+        error_return("bst_save: unable to size %s", tmp);
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        return false;
+    }
+
+    bst_file_header *header = (bst_file_header *)map;
+    memcpy(header->magic, BST_FILE_MAGIC, sizeof(header->magic));
+    header->version = BST_FILE_VERSION;
+    header->order = BST_FILE_ORDER;
+    header->size = size;
+    header->count = count;
+    header->elems = sizeof(bst_file_header);
+
+    bst_frozen f = {map + sizeof(bst_file_header), size, count, 0, NULL,
+                    NULL, 0};
+    bst_iter it;
+    const void *data;
+    size_t k = first(&f);
+
+    bst_iter_init(&it, tree);
+    while ((data = bst_iter_next(&it))) {
+        memcpy(elem(&f, k), data, size);
+        k = successor(&f, k);
+    }
+
+    tree_unlock(tree);
+
+    bool saved = munmap(map, len) == 0 && fsync(fd) == 0;
+    saved = close(fd) == 0 && saved;
+    if (!saved || rename(tmp, path) != 0) {
+        error_return("bst_save: unable to write %s", path);
+        unlink(tmp);
+        saved = false;
+    }
+    free(tmp);
+
+    return saved;
+}
+
+/**
+ * bst_mmap_open:
+ *      Map a file written by bst_save read only and return a snapshot
+ *      searching it in place, ordered by cmp which must match the tree
+ *      that was saved. Nothing is read up front, pages are faulted in by
+ *      searches and shared with every process mapping the same file.
+ *      bst_frozen_delete unmaps it. Return NULL if the file cannot be
+ *      opened or was not written by a compatible bst_save.
+ */
+bst_frozen *bst_mmap_open(const char *path, comparator cmp) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        error_return("bst_mmap_open: unable to open %s", path);
+        return NULL;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    size_t len = 0;
+    if (fstat(fd, &st) == 0) {
+        len = (size_t)st.st_size;
+        map = len < sizeof(bst_file_header)
+                  ? NULL // too short to hold a header
+                  : mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        error_return("bst_mmap_open: unable to map %s", path);
+        return NULL;
+    }
+
+    const bst_file_header *header = map;
+    size_t room = len - sizeof(bst_file_header);
+    if (!map ||
+        memcmp(header->magic, BST_FILE_MAGIC, sizeof(header->magic)) ||
+        header->version != BST_FILE_VERSION ||
+        header->order != BST_FILE_ORDER || header->size == 0 ||
+        header->elems != sizeof(bst_file_header) ||
+        header->count >= room / header->size) {
+        if (map) {
+            munmap(map, len);
+        }
+        error_message("bst_mmap_open: %s is not a compatible tree file", path);
+        return NULL;
+    }
+
+    bst_frozen *f = calloc(1, sizeof(bst_frozen));
+    if (!f) {
+        error_syscall("Unable to allocate memory for bst_frozen");
+    }
+
+    f->elems = (unsigned char *)map + header->elems;
+    f->size = header->size;
+    f->count = header->count;
+    f->ahead = prefetch_levels(f->size);
+    f->cmp = cmp;
+    f->map = map;
+    f->map_len = len;
+
+    return f;
+}
+
+/**
+ * load_slot:
+ *      Build the subtree at slot k of a snapshot. The slots already form
+ *      a complete binary tree, so node k simply takes slots 2k and 2k + 1
+ *      as its children and the result is balanced without any rotations.
+ */
+static bst_node *load_slot(const bst_frozen *f, size_t k,
+                           const bst_allocator *alloc) {
+    if (k > f->count) {
+        return NULL;
+    }
+
+    bst_node *node = bst_alloc_node(f->size, elem(f, k), f->size, alloc);
+
+    node->left = load_slot(f, 2 * k, alloc);
+    node->right = load_slot(f, 2 * k + 1, alloc);
+    node->height = bst_height(node->left) + 1; // the left side is deeper
+    node->count = 1 + bst_size(node->left) + bst_size(node->right);
+
+    return node;
+}
+
+/**
+ * bst_load:
+ *      Read a file written by bst_save into a new tree ordered by cmp,
+ *      which must match the tree that was saved, in O(n) time with no
+ *      comparisons. The new tree never owns string keys, as trees that
+ *      do cannot be saved. Return NULL if the file cannot be read.
+ */
+bst_tree *bst_load(const char *path, comparator cmp, free_func freefn) {
+    bst_frozen *f = bst_mmap_open(path, cmp);
+    if (!f) {
+        return NULL;
+    }
+
+    // Every page is read once, tell the kernel to stream them in
+    madvise(f->map, f->map_len, MADV_WILLNEED);
+
+    bst_tree *tree = bst_tree_new(f->size, cmp, freefn);
+    tree->root = load_slot(f, 1, &tree->alloc);
+    tree->count = f->count;
+    bst_frozen_delete(f);
+
+    return tree;
+}
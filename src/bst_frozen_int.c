@@ -0,0 +1,298 @@
+/**
+ * bst_frozen_int.c - Vectorised searches over frozen int snapshots.
+ *
+ * Copyright (c) 2024 Michael Berry
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bst_private.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+// Keys are stored as a static B-tree of 64 byte blocks holding 16 sorted
+// keys each, block k has children k * 17 + 1 to k * 17 + 17 in block
+// order. One block fills a cache line and a search compares the key
+// against a whole block at once, the number of smaller keys in the block
+// is both the candidate slot and the child to descend into. Unused slots
+// hold INT_MAX, which sorts after every real key.
+
+#define BLOCK 16
+
+struct bst_frozen_int {
+    int *keys;          // nblocks * BLOCK keys, cache line aligned
+    size_t nblocks;     // number of blocks
+    size_t count;       // number of real keys
+    bool has_max;       // INT_MAX is a real key and not just padding
+    const char *kernel; // name of the search kernel in use
+    // The search kernel itself
+    const int *(*search)(const bst_frozen_int *, int);
+};
+
+/**
+ * child:
+ *      Index of child i of block k.
+ */
+static inline size_t child(size_t k, unsigned i) {
+    return k * (BLOCK + 1) + i + 1;
+}
+
+/**
+ * DEFINE_SEARCH:
+ *      Define a lower bound search returning the first slot not less than
+ *      key, or NULL, with rank counting the keys in a block below key.
+ */
+#define DEFINE_SEARCH(name, rank, attr)                                        \
+    attr static const int *name(const bst_frozen_int *f, int key) {            \
+        const int *found = NULL;                                               \
+        size_t k = 0;                                                          \
+                                                                               \
+        while (k < f->nblocks) {                                               \
+            const int *block = f->keys + k * BLOCK;                            \
+            unsigned i = rank(block, key);                                     \
+                                                                               \
+            if (i < BLOCK) {                                                   \
+                found = block + i;                                             \
+            }                                                                  \
+            k = child(k, i);                                                   \
+        }                                                                      \
+                                                                               \
+        return found;                                                          \
+    }
+
+/**
+ * rank_scalar:
+ *      Count the keys in a block below key one at a time.
+ */
+static inline unsigned rank_scalar(const int *block, int key) {
+    unsigned n = 0;
+
+    for (unsigned i = 0; i < BLOCK; i++) {
+        n += block[i] < key;
+    }
+
+    return n;
+}
+
+DEFINE_SEARCH(search_scalar, rank_scalar, )
+
+#if defined(HAVE_X86_KERNELS)
+/**
+ * rank_sse2:
+ *      Count the keys in a block below key four lanes at a time, the four
+ *      comparison masks are narrowed to one byte per key.
+ */
+__attribute__((target("sse2"))) static inline unsigned
+rank_sse2(const int *block, int key) {
+    const __m128i *b = (const __m128i *)block;
+    __m128i k = _mm_set1_epi32(key);
+    __m128i lo = _mm_packs_epi32(_mm_cmpgt_epi32(k, _mm_load_si128(b)),
+                                 _mm_cmpgt_epi32(k, _mm_load_si128(b + 1)));
+    __m128i hi = _mm_packs_epi32(_mm_cmpgt_epi32(k, _mm_load_si128(b + 2)),
+                                 _mm_cmpgt_epi32(k, _mm_load_si128(b + 3)));
+
+    return __builtin_popcount(_mm_movemask_epi8(_mm_packs_epi16(lo, hi)));
+}
+
+DEFINE_SEARCH(search_sse2, rank_sse2, __attribute__((target("sse2"))))
+
+/**
+ * rank_avx2:
+ *      Count the keys in a block below key eight lanes at a time. The pack
+ *      interleaves lanes, which does not matter as only the count is used,
+ *      each key sets two mask bits.
+ */
+__attribute__((target("avx2"))) static inline unsigned
+rank_avx2(const int *block, int key) {
+    const __m256i *b = (const __m256i *)block;
+    __m256i k = _mm256_set1_epi32(key);
+    __m256i lt = _mm256_packs_epi32(
+        _mm256_cmpgt_epi32(k, _mm256_load_si256(b)),
+        _mm256_cmpgt_epi32(k, _mm256_load_si256(b + 1)));
+
+    return __builtin_popcount(_mm256_movemask_epi8(lt)) / 2;
+}
+
+DEFINE_SEARCH(search_avx2, rank_avx2, __attribute__((target("avx2"))))
+#endif
+
+/**
+ * fill:
+ *      Place the sorted keys into the subtree of block k in order,
+ *      padding with INT_MAX once they run out.
+ */
+static void fill(bst_frozen_int *f, size_t k, const int **next,
+                 const int *end) {
+    if (k >= f->nblocks) {
+        return;
+    }
+
+    for (unsigned i = 0; i < BLOCK; i++) {
+        fill(f, child(k, i), next, end);
+        f->keys[k * BLOCK + i] = *next < end ? *(*next)++ : INT_MAX;
+    }
+    fill(f, child(k, BLOCK), next, end);
+}
+
+/**
+ * bst_frozen_int_use_kernel:
+ *      Switch the snapshot to the named search kernel, "avx2", "sse2" or
+ *      "scalar". Return false if the kernel is not supported here.
+ */
+bool bst_frozen_int_use_kernel(bst_frozen_int *f, const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        f->search = search_scalar;
+#if defined(HAVE_X86_KERNELS)
+    } else if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        f->search = search_sse2;
+    } else if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        f->search = search_avx2;
+#endif
+    } else {
+        return false;
+    }
+
+    f->kernel = strcmp(name, "avx2") == 0   ? "avx2"
+                : strcmp(name, "sse2") == 0 ? "sse2"
+                                            : "scalar";
+    return true;
+}
+
+/**
+ * bst_freeze_int:
+ *      Copy the keys of a tree of int elements in ascending order, such
+ *      as one ordered by compare_int, into a new immutable snapshot and
+ *      pick the fastest search kernel the CPU supports. Return NULL if
+ *      the elements are not ints in ascending order.
+ */
+bst_frozen_int *bst_freeze_int(const bst_tree *tree) {
+    if (tree->size != sizeof(int)) {
+        return NULL;
+    }
+
+    tree_read_lock(tree);
+
+    int *sorted = malloc((tree->count ? tree->count : 1) * sizeof(int));
+    if (!sorted) {
+        error_syscall("Unable to allocate memory for bst_frozen_int");
+    }
+
+    bst_iter it;
+    const int *data;
+    size_t n = 0;
+
+    bst_iter_init(&it, tree);
+    while ((data = bst_iter_next(&it))) {
+        if (n && sorted[n - 1] >= *data) {
+            tree_unlock(tree);
+            free(sorted);
+            return NULL;
+        }
+        sorted[n++] = *data;
+    }
+
+    tree_unlock(tree);
+
+    bst_frozen_int *f = calloc(1, sizeof(bst_frozen_int));
+    if (!f) {
+        error_syscall("Unable to allocate memory for bst_frozen_int");
+    }
+
+    f->count = n;
+    f->nblocks = (n + BLOCK - 1) / BLOCK;
+    f->has_max = n && sorted[n - 1] == INT_MAX;
+    if (posix_memalign((void **)&f->keys, CACHE_LINE,
+                       (f->nblocks ? f->nblocks : 1) * BLOCK * sizeof(int))) {
+        error_syscall("Unable to allocate memory for bst_frozen_int");
+    }
+
+    const int *next = sorted;
+    fill(f, 0, &next, sorted + n);
+    free(sorted);
+
+    if (!bst_frozen_int_use_kernel(f, "avx2") &&
+        !bst_frozen_int_use_kernel(f, "sse2")) {
+        bst_frozen_int_use_kernel(f, "scalar");
+    }
+
+    return f;
+}
+
+/**
+ * bst_frozen_int_delete:
+ *      Free a snapshot.
+ */
+void bst_frozen_int_delete(bst_frozen_int *f) {
+    if (!f) {
+        return;
+    }
+
+    free(f->keys);
+    free(f);
+}
+
+/**
+ * bst_frozen_int_size:
+ *      Number of keys in the snapshot.
+ */
+size_t bst_frozen_int_size(const bst_frozen_int *f) { return f->count; }
+
+/**
+ * bst_frozen_int_kernel:
+ *      Name of the search kernel in use.
+ */
+const char *bst_frozen_int_kernel(const bst_frozen_int *f) {
+    return f->kernel;
+}
+
+/**
+ * bst_frozen_int_ceil:
+ *      Store the smallest key not less than key in *out.
+ *      Return false if there is none.
+ */
+bool bst_frozen_int_ceil(const bst_frozen_int *f, int key, int *out) {
+    const int *found = f->search(f, key);
+
+    // Padding sorts after the real keys, so finding INT_MAX only means
+    // a real key when INT_MAX was stored
+    if (!found || (*found == INT_MAX && !f->has_max)) {
+        return false;
+    }
+
+    *out = *found;
+    return true;
+}
+
+/**
+ * bst_frozen_int_contains:
+ *      Return true if key is in the snapshot.
+ */
+bool bst_frozen_int_contains(const bst_frozen_int *f, int key) {
+    int found;
+
+    return bst_frozen_int_ceil(f, key, &found) && found == key;
+}
@@ -0,0 +1,178 @@
+/**
+ * bst_parallel.c - Traversals split across the thread pool by subtree.
+ *
+ * Copyright (c) 2024 Michael Berry
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bst_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// A subtree above the cutoff forks its left child onto the pool and walks
+// the node and its right child itself, smaller subtrees are walked in
+// order without recursion. The subtree counts make the split free.
+
+// Subtrees smaller than this are walked by one thread
+#define PARALLEL_CUTOFF 8192
+
+// Shared arguments of a parallel walk
+typedef struct walk_ctx {
+    apply_func apply;
+    fold_func fold;
+    combine_func combine;
+    free_func_r destroy; // releases what a combined accumulator owns
+    size_t acc_size;
+    const void *init; // copy of the empty accumulator
+    void *arg;
+} walk_ctx;
+
+// A subtree walk, possibly run on another thread
+typedef struct walk {
+    const walk_ctx *ctx;
+    bst_node *root;
+    void *acc;
+} walk;
+
+/**
+ * walk_inorder:
+ *      Apply or fold every element under root in order.
+ */
+static void walk_inorder(const walk_ctx *c, bst_node *root, void *acc) {
+    bst_node *stack[BST_MAX_HEIGHT];
+    size_t depth = 0;
+
+    while (root || depth) {
+        while (root) {
+            stack[depth++] = root;
+            root = root->left;
+        }
+
+        root = stack[--depth];
+        if (c->fold) {
+            c->fold(acc, root->data, c->arg);
+        } else {
+            c->apply(root->data, c->arg);
+        }
+        root = root->right;
+    }
+}
+
+/**
+ * walk_subtree:
+ *      Task body, walk w->root into w->acc, splitting large subtrees.
+ *
+ *      The left child continues in the accumulator handed down, which
+ *      holds everything before it, while the node and right child start
+ *      a fresh one that is combined after. Results therefore reach the
+ *      reducer in order whatever order the tasks finish in.
+ */
+static void walk_subtree(void *arg) {
+    walk *w = arg;
+    const walk_ctx *c = w->ctx;
+    bst_node *root = w->root;
+
+    if (bst_size(root) < PARALLEL_CUTOFF) {
+        walk_inorder(c, root, w->acc);
+        return;
+    }
+
+    walk left = {c, root->left, w->acc};
+    walk right = {c, root->right, NULL};
+    bst_task task;
+
+    if (c->fold) {
+        right.acc = malloc(c->acc_size);
+        if (!right.acc) {
+            error_syscall("Unable to allocate memory for bst_reduce");
+        }
+        memcpy(right.acc, c->init, c->acc_size);
+    }
+
+    bst_task_fork(&task, walk_subtree, &left);
+    if (c->fold) {
+        c->fold(right.acc, root->data, c->arg);
+    } else {
+        c->apply(root->data, c->arg);
+    }
+    walk_subtree(&right);
+    bst_task_join(&task);
+
+    if (c->fold) {
+        c->combine(w->acc, right.acc, c->arg);
+        if (c->destroy) {
+            c->destroy(right.acc, c->arg);
+        }
+        free(right.acc);
+    }
+}
+
+/**
+ * bst_parallel_for_each:
+ *      Call apply on every element with arg, spreading the work over the
+ *      thread pool. Calls run concurrently in no particular order, so
+ *      apply must be thread safe, and it must not call tree functions.
+ */
+void bst_parallel_for_each(const bst_tree *tree, apply_func apply, void *arg) {
+    walk_ctx c = {apply, NULL, NULL, NULL, 0, NULL, arg};
+    walk w = {&c, NULL, NULL};
+
+    tree_read_lock(tree);
+    w.root = tree->root;
+    walk_subtree(&w);
+    tree_unlock(tree);
+}
+
+/**
+ * bst_reduce:
+ *      Reduce the tree in parallel into acc, an accumulator of acc_size
+ *      bytes that holds the empty value on entry. Each subtree is folded
+ *      in order into its own copy of the empty value. Partial results
+ *      are combined left to right, so an associative combine gives the
+ *      same result as a sequential in-order fold, even one that is not
+ *      commutative such as concatenation. fold and combine may run
+ *      concurrently on different accumulators and must not call tree
+ *      functions.
+ *
+ *      Fresh accumulators are byte copies of the empty value, which must
+ *      therefore own nothing yet. Once an accumulator is combined into
+ *      the one before it, destroy, if given, is called on it with arg to
+ *      release whatever fold made it own, such as a growing buffer.
+ */
+void bst_reduce(const bst_tree *tree, void *acc, size_t acc_size,
+                fold_func fold, combine_func combine, free_func_r destroy,
+                void *arg) {
+    void *init = malloc(acc_size ? acc_size : 1);
+    if (!init) {
+        error_syscall("Unable to allocate memory for bst_reduce");
+    }
+    memcpy(init, acc, acc_size);
+
+    walk_ctx c = {NULL, fold, combine, destroy, acc_size, init, arg};
+    walk w = {&c, NULL, acc};
+
+    tree_read_lock(tree);
+    w.root = tree->root;
+    walk_subtree(&w);
+    tree_unlock(tree);
+
+    free(init);
+}
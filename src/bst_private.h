@@ -0,0 +1,108 @@
+/**
+ * bst_private.h - Definitions shared by the libbst sources.
+ *
+ * Copyright (c) 2024 Michael Berry
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BST_PRIVATE_H
+#define BST_PRIVATE_H
+
+#include "../include/bst.h"
+
+#include <pthread.h>
+
+// Assumed cache line size for alignment and padding
+#define CACHE_LINE 64
+
+#if defined(__GNUC__)
+#define prefetch(addr) __builtin_prefetch(addr)
+#else
+#define prefetch(addr) ((void)(addr))
+#endif
+
+// Bump allocated string storage, see bst_strings.c
+typedef struct bst_arena bst_arena;
+
+struct bst_tree {
+    bst_node *root;
+    size_t size;         // element size in bytes
+    size_t count;        // number of elements in the tree
+    comparator cmp;      // element ordering
+    free_func freefn;    // releases what an element refers to, may be NULL
+    bst_allocator alloc; // where nodes come from
+    bool concurrent;     // lock is initialised and taken by every call
+    pthread_rwlock_t lock;
+    bst_arena *strings;  // copies of owned string keys, or NULL
+    bst_intern *intern;  // table owned string keys go through, or NULL
+};
+
+/**
+ * tree_read_lock, tree_write_lock, tree_unlock:
+ *      Take or drop the tree lock, no-ops unless the tree is concurrent.
+ */
+static inline void tree_read_lock(const bst_tree *tree) {
+    if (tree->concurrent) {
+        pthread_rwlock_rdlock((pthread_rwlock_t *)&tree->lock);
+    }
+}
+
+static inline void tree_write_lock(bst_tree *tree) {
+    if (tree->concurrent) {
+        pthread_rwlock_wrlock(&tree->lock);
+    }
+}
+
+static inline void tree_unlock(const bst_tree *tree) {
+    if (tree->concurrent) {
+        pthread_rwlock_unlock((pthread_rwlock_t *)&tree->lock);
+    }
+}
+
+// Work item run by the internal thread pool
+enum { TASK_QUEUED, TASK_RUNNING, TASK_DONE };
+
+typedef struct bst_task {
+    void (*fn)(void *);
+    void *arg;
+    int state; // guarded by the pool lock
+} bst_task;
+
+// Node helpers shared between sources
+bst_node *bst_alloc_node(size_t, const void *, size_t,
+                         const bst_allocator *);
+void bst_free_node(bst_node *, free_func, const bst_allocator *);
+void bst_free_subtree(bst_node *, free_func, const bst_allocator *);
+void bst_update_node(bst_node *);
+bool bst_heap_allocated(const bst_allocator *);
+
+// String arenas
+bst_arena *bst_arena_new(void);
+void bst_arena_delete(bst_arena *);
+const char *bst_arena_strdup(bst_arena *, const char *, size_t);
+void bst_arena_merge(bst_arena *, bst_arena *);
+const char *bst_intern_str_len(bst_intern *, const char *, size_t);
+
+// Fork join on the internal thread pool
+size_t bst_task_workers(void);
+void bst_task_fork(bst_task *, void (*)(void *), void *);
+void bst_task_join(bst_task *);
+
+#endif
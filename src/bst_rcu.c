@@ -0,0 +1,551 @@
+/**
+ * bst_rcu.c - AVL trees read without locks, updated by path copying.
+ *
+ * Copyright (c) 2024 Michael Berry
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bst_private.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Published nodes are never written again. A writer copies the path from
+// the root to the change, rebalances the copies with the ordinary
+// rotations and then publishes the new root with one atomic store. A
+// reader therefore sees either the old tree or the new one and needs no
+// lock.
+//
+// Replaced nodes are retired, not freed, until no reader can still hold
+// them. Epoch based reclamation decides when that is. Each reader has
+// its own cache line slot where it records the global epoch it entered
+// under. A writer advances the global epoch once every active reader
+// has caught up with it. Nodes retired in epoch e are unreachable for
+// every reader once the epoch reaches e + 2, and are freed then.
+//
+// A reader announcing its epoch then loading the root, and a writer
+// storing the root then scanning the slots, must not both miss the
+// other's store. The slot store, the root store and the loads of both
+// are sequentially consistent for that reason. Node fields are plain
+// loads ordered by the root load.
+
+// Bits of a reader slot state, the epoch is stored shifted above ACTIVE
+#define ACTIVE 1UL
+
+// Fresh nodes a single update can create: one copy per level, the new
+// or replacement node and up to two copies per level for rotations
+#define MAX_FRESH (3 * BST_MAX_HEIGHT + 4)
+
+struct bst_rcu_reader {
+    unsigned long state; // epoch << 1 | ACTIVE while in a read section
+    bst_rcu *tree;
+    bool in_use;
+    unsigned char pad[CACHE_LINE - sizeof(unsigned long) - sizeof(bst_rcu *) -
+                      sizeof(bool)];
+};
+
+// A replaced node waiting for readers to move on
+typedef struct retired_node {
+    bst_node *node;
+    unsigned long epoch; // global epoch when it was retired
+    bool free_elem;      // the element left the tree, call freefn on it
+} retired_node;
+
+struct bst_rcu {
+    bst_node *root;          // current version, accessed atomically
+    size_t size;             // element size in bytes
+    size_t count;            // number of elements, read atomically
+    comparator cmp;          // element ordering
+    free_func freefn;        // releases what an element refers to
+    unsigned long epoch;     // global epoch
+    pthread_mutex_t writer;  // serialises updates and registration
+    bst_rcu_reader **readers; // registered reader slots
+    size_t nreaders;
+    retired_node *retired;   // nodes waiting for a grace period
+    size_t nretired;
+    size_t retired_cap;
+};
+
+// Nodes created by the update in progress, not yet visible to readers
+typedef struct rcu_update {
+    bst_rcu *tree;
+    bst_node *fresh[MAX_FRESH];
+    size_t nfresh;
+} rcu_update;
+
+/**
+ * push_step:
+ *      Record node and the direction taken from it on the path of an
+ *      update, quitting with the name of the caller if the path outgrows
+ *      BST_MAX_HEIGHT.
+ */
+static inline void push_step(bst_node **path, bool *dirs, size_t *depth,
+                             bst_node *node, bool dir, const char *caller) {
+    if (*depth == BST_MAX_HEIGHT) {
+        error_quit("%s: tree is deeper than %d", caller, BST_MAX_HEIGHT);
+    }
+
+    path[*depth] = node;
+    dirs[(*depth)++] = dir;
+}
+
+/**
+ * balance:
+ *      Balance factor of node.
+ */
+static int balance(bst_node *node) {
+    return (int)bst_height(node->left) - (int)bst_height(node->right);
+}
+
+/**
+ * retire:
+ *      Queue node to be freed after a grace period.
+ */
+static void retire(bst_rcu *t, bst_node *node, bool free_elem) {
+    if (t->nretired == t->retired_cap) {
+        size_t cap = t->retired_cap ? 2 * t->retired_cap : 64;
+        retired_node *r = realloc(t->retired, cap * sizeof(retired_node));
+        if (!r) {
+            error_syscall("Unable to grow bst_rcu retire list");
+        }
+        t->retired = r;
+        t->retired_cap = cap;
+    }
+
+    t->retired[t->nretired++] = (retired_node){node, t->epoch, free_elem};
+}
+
+/**
+ * fresh_node:
+ *      Allocate an unpublished node holding a copy of elem with the given
+ *      children.
+ */
+static bst_node *fresh_node(rcu_update *u, const void *elem, bst_node *left,
+                            bst_node *right) {
+    bst_node *node = malloc(sizeof(bst_node) + u->tree->size);
+    if (!node) {
+        error_syscall("Unable to allocate memory for bst_rcu node");
+    }
+
+    memcpy(node->data, elem, u->tree->size);
+    node->left = left;
+    node->right = right;
+    bst_update_node(node);
+    u->fresh[u->nfresh++] = node;
+
+    return node;
+}
+
+/**
+ * copy_node:
+ *      Replace a published node with an unpublished copy and retire it.
+ */
+static bst_node *copy_node(rcu_update *u, bst_node *node) {
+    retire(u->tree, node, false);
+    return fresh_node(u, node->data, node->left, node->right);
+}
+
+/**
+ * own:
+ *      Return a node the update may modify in place of node, copying it
+ *      unless the update created it.
+ */
+static bst_node *own(rcu_update *u, bst_node *node) {
+    for (size_t i = u->nfresh; i--;) {
+        if (u->fresh[i] == node) {
+            return node;
+        }
+    }
+
+    return copy_node(u, node);
+}
+
+/**
+ * rebalance:
+ *      Rebalance the owned node with bst_rotate_left and bst_rotate_right
+ *      after owning every node the rotations rewrite, return the root of
+ *      the subtree.
+ */
+static bst_node *rebalance(rcu_update *u, bst_node *node) {
+    bst_update_node(node);
+
+    int b = balance(node);
+    if (b > 1) {
+        node->left = own(u, node->left);
+        if (balance(node->left) < 0) {
+            node->left->right = own(u, node->left->right);
+            node->left = bst_rotate_left(node->left);
+        }
+        return bst_rotate_right(node);
+    }
+
+    if (b < -1) {
+        node->right = own(u, node->right);
+        if (balance(node->right) > 0) {
+            node->right->left = own(u, node->right->left);
+            node->right = bst_rotate_right(node->right);
+        }
+        return bst_rotate_left(node);
+    }
+
+    return node;
+}
+
+/**
+ * copy_path:
+ *      Rebuild the depth nodes of path bottom up over the new subtree
+ *      child, dirs[i] telling which side of path[i] it hangs from, and
+ *      return the new root.
+ */
+static bst_node *copy_path(rcu_update *u, bst_node **path, const bool *dirs,
+                           size_t depth, bst_node *child) {
+    while (depth--) {
+        bst_node *node = copy_node(u, path[depth]);
+
+        if (dirs[depth]) {
+            node->right = child;
+        } else {
+            node->left = child;
+        }
+        child = rebalance(u, node);
+    }
+
+    return child;
+}
+
+/**
+ * synchronize:
+ *      Advance the epoch if every active reader has seen the current one,
+ *      then free what no reader can reach any more. Writer lock held.
+ */
+static void synchronize(bst_rcu *t) {
+    bool advance = true;
+
+    for (size_t i = 0; i < t->nreaders && advance; i++) {
+        unsigned long state =
+            __atomic_load_n(&t->readers[i]->state, __ATOMIC_SEQ_CST);
+        advance = !(state & ACTIVE) || (state >> 1) == t->epoch;
+    }
+
+    if (advance) {
+        __atomic_store_n(&t->epoch, t->epoch + 1, __ATOMIC_RELEASE);
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < t->nretired; i++) {
+        retired_node *r = &t->retired[i];
+
+        if (r->epoch + 2 <= t->epoch) {
+            if (r->free_elem && t->freefn) {
+                t->freefn(r->node->data);
+            }
+            free(r->node);
+        } else {
+            t->retired[kept++] = *r;
+        }
+    }
+    t->nretired = kept;
+}
+
+/**
+ * publish:
+ *      Make root the tree readers see and reclaim what is safe to.
+ */
+static void publish(bst_rcu *t, bst_node *root) {
+    __atomic_store_n(&t->root, root, __ATOMIC_SEQ_CST);
+    synchronize(t);
+}
+
+/**
+ * bst_rcu_new:
+ *      Create an empty tree of size byte elements kept in cmp order,
+ *      freefn is called on every element that leaves the tree once no
+ *      reader can see it.
+ */
+bst_rcu *bst_rcu_new(size_t size, comparator cmp, free_func freefn) {
+    bst_rcu *t = calloc(1, sizeof(bst_rcu));
+    if (!t) {
+        error_syscall("Unable to allocate memory for bst_rcu");
+    }
+
+    t->size = size;
+    t->cmp = cmp;
+    t->freefn = freefn;
+
+    int err = pthread_mutex_init(&t->writer, NULL);
+    if (err) {
+        errno = err;
+        error_syscall("Unable to initialise bst_rcu lock");
+    }
+
+    return t;
+}
+
+/**
+ * bst_rcu_delete:
+ *      Delete every element, calling display on each first if given, and
+ *      free the tree. No reader may be in a read section and every reader
+ *      handle is freed along with it.
+ */
+void bst_rcu_delete(bst_rcu *t, display_func display) {
+    if (!t) {
+        return;
+    }
+
+    for (size_t i = 0; i < t->nretired; i++) {
+        if (t->retired[i].free_elem && t->freefn) {
+            t->freefn(t->retired[i].node->data);
+        }
+        free(t->retired[i].node);
+    }
+
+    for (size_t i = 0; i < t->nreaders; i++) {
+        free(t->readers[i]);
+    }
+
+    bst_delete_tree(t->root, t->freefn, display);
+    pthread_mutex_destroy(&t->writer);
+    free(t->retired);
+    free(t->readers);
+    free(t);
+}
+
+/**
+ * bst_rcu_register:
+ *      Return a reader handle for the calling thread, each thread reading
+ *      the tree needs its own.
+ */
+bst_rcu_reader *bst_rcu_register(bst_rcu *t) {
+    bst_rcu_reader *r = NULL;
+
+    pthread_mutex_lock(&t->writer);
+    for (size_t i = 0; i < t->nreaders && !r; i++) {
+        if (!t->readers[i]->in_use) {
+            r = t->readers[i];
+        }
+    }
+
+    if (!r) {
+        bst_rcu_reader **readers =
+            realloc(t->readers, (t->nreaders + 1) * sizeof(bst_rcu_reader *));
+        if (!readers ||
+            posix_memalign((void **)&r, CACHE_LINE, sizeof(bst_rcu_reader))) {
+            error_syscall("Unable to allocate bst_rcu reader");
+        }
+
+        t->readers = readers;
+        t->readers[t->nreaders++] = r;
+    }
+
+    r->state = 0;
+    r->tree = t;
+    r->in_use = true;
+    pthread_mutex_unlock(&t->writer);
+
+    return r;
+}
+
+/**
+ * bst_rcu_unregister:
+ *      Give back a reader handle, it must not be in a read section.
+ */
+void bst_rcu_unregister(bst_rcu_reader *r) {
+    bst_rcu *t = r->tree;
+
+    pthread_mutex_lock(&t->writer);
+    r->in_use = false;
+    pthread_mutex_unlock(&t->writer);
+}
+
+/**
+ * bst_rcu_read_lock:
+ *      Enter a read section. Elements and nodes seen inside it stay valid
+ *      until bst_rcu_read_unlock. Only this thread's own cache line is
+ *      written, and lookups inside the section do no atomic read modify
+ *      write operations. Sections do not nest.
+ */
+void bst_rcu_read_lock(bst_rcu_reader *r) {
+    // Acquire pairs with the writer's release of a new epoch, so a
+    // reader announcing it also sees the root published before it
+    unsigned long epoch = __atomic_load_n(&r->tree->epoch, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&r->state, epoch << 1 | ACTIVE, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * bst_rcu_read_unlock:
+ *      Leave a read section.
+ */
+void bst_rcu_read_unlock(bst_rcu_reader *r) {
+    __atomic_store_n(&r->state, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * bst_rcu_root:
+ *      Root of the current version, for use inside a read section with
+ *      the per node functions that do not modify the tree.
+ */
+bst_node *bst_rcu_root(const bst_rcu *t) {
+    return __atomic_load_n(&t->root, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * bst_rcu_lookup:
+ *      Return the element equal to key, or NULL. Call inside a read
+ *      section, the element stays valid until it ends.
+ */
+void *bst_rcu_lookup(const bst_rcu *t, const void *key) {
+    bst_node *curr = bst_rcu_root(t);
+
+    while (curr) {
+        result dir = t->cmp(key, curr->data);
+        if (dir == EQUAL) {
+            return curr->data;
+        }
+
+        if (dir == LESSER) {
+            curr = curr->left;
+        } else {
+            curr = curr->right;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * bst_rcu_size:
+ *      Number of elements in the tree.
+ */
+size_t bst_rcu_size(const bst_rcu *t) {
+    return __atomic_load_n(&t->count, __ATOMIC_RELAXED);
+}
+
+/**
+ * bst_rcu_insert:
+ *      Copy the element at elem into a new version of the tree and
+ *      publish it. Writers are serialised, readers are never blocked.
+ *      Return true if it was added, false if an equal element exists.
+ */
+bool bst_rcu_insert(bst_rcu *t, const void *elem) {
+    bst_node *path[BST_MAX_HEIGHT];
+    bool dirs[BST_MAX_HEIGHT];
+    size_t depth = 0;
+    rcu_update u;
+
+    pthread_mutex_lock(&t->writer);
+    u.tree = t;
+    u.nfresh = 0;
+
+    bst_node *curr = t->root;
+    while (curr) {
+        result dir = t->cmp(elem, curr->data);
+        if (dir == EQUAL) {
+            pthread_mutex_unlock(&t->writer);
+            return false;
+        }
+
+        push_step(path, dirs, &depth, curr, dir == GREATER, "bst_rcu_insert");
+        curr = dir == LESSER ? curr->left : curr->right;
+    }
+
+    bst_node *leaf = fresh_node(&u, elem, NULL, NULL);
+    publish(t, copy_path(&u, path, dirs, depth, leaf));
+    __atomic_store_n(&t->count, t->count + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&t->writer);
+
+    return true;
+}
+
+/**
+ * bst_rcu_remove:
+ *      Publish a new version of the tree without the element equal to
+ *      key. Return true if one was found and removed.
+ *
+ *      A node with two children is replaced by a copy of its inorder
+ *      successor placed over a copy of the right subtree without it.
+ */
+bool bst_rcu_remove(bst_rcu *t, const void *key) {
+    bst_node *path[BST_MAX_HEIGHT];
+    bool dirs[BST_MAX_HEIGHT];
+    size_t depth = 0;
+    rcu_update u;
+
+    pthread_mutex_lock(&t->writer);
+    u.tree = t;
+    u.nfresh = 0;
+
+    bst_node *curr = t->root;
+    while (curr) {
+        result dir = t->cmp(key, curr->data);
+        if (dir == EQUAL) {
+            break;
+        }
+
+        push_step(path, dirs, &depth, curr, dir == GREATER, "bst_rcu_remove");
+        curr = dir == LESSER ? curr->left : curr->right;
+    }
+
+    if (!curr) {
+        pthread_mutex_unlock(&t->writer);
+        return false;
+    }
+
+    bst_node *replacement;
+    if (!curr->left || !curr->right) {
+        replacement = curr->left ? curr->left : curr->right;
+    } else {
+        bst_node *spath[BST_MAX_HEIGHT];
+        bool sdirs[BST_MAX_HEIGHT];
+        size_t sdepth = 0;
+        bst_node *succ = curr->right;
+
+        while (succ->left) {
+            push_step(spath, sdirs, &sdepth, succ, false, "bst_rcu_remove");
+            succ = succ->left;
+        }
+
+        bst_node *right = copy_path(&u, spath, sdirs, sdepth, succ->right);
+        replacement = fresh_node(&u, succ->data, curr->left, right);
+        replacement = rebalance(&u, replacement);
+        retire(t, succ, false);
+    }
+
+    retire(t, curr, true);
+    publish(t, copy_path(&u, path, dirs, depth, replacement));
+    __atomic_store_n(&t->count, t->count - 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&t->writer);
+
+    return true;
+}
+
+/**
+ * bst_rcu_synchronize:
+ *      Try to end the current grace period and free retired nodes. Every
+ *      update already does this, call it to reclaim memory once updates
+ *      stop.
+ */
+void bst_rcu_synchronize(bst_rcu *t) {
+    pthread_mutex_lock(&t->writer);
+    synchronize(t);
+    pthread_mutex_unlock(&t->writer);
+}
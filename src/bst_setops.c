@@ -0,0 +1,384 @@
+/**
+ * bst_setops.c - Join based split, union, intersection and difference.
+ *
+ * Copyright (c) 2024 Michael Berry
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bst_private.h"
+
+// Union, intersection and difference follow the join based algorithms of
+// Blelloch, Ferizovic and Sun. Splitting one tree by the root of the
+// other leaves two independent subproblems, which run on the thread pool
+// when both are large, and join puts the halves back together in time
+// proportional to their height difference. The total work is
+// O(m log(n / m + 1)) for trees of m <= n elements.
+
+// Subproblems smaller than this run in the calling thread
+#define PARALLEL_CUTOFF 4096
+
+// What a set operation needs beyond the trees
+typedef struct set_ctx {
+    comparator cmp;
+    free_func freefn;
+    const bst_allocator *alloc;
+    bool parallel; // nodes may be freed from several threads
+} set_ctx;
+
+typedef bst_node *(*set_func)(const set_ctx *, bst_node *, bst_node *);
+
+// One half of a split operation, possibly run on another thread
+typedef struct set_half {
+    const set_ctx *ctx;
+    set_func fn;
+    bst_node *a;
+    bst_node *b;
+    bst_node *result;
+} set_half;
+
+/**
+ * join_right:
+ *      Join when l is more than one level taller than r, descending the
+ *      right spine of l to a subtree of about r's height and rotating on
+ *      the way back up.
+ */
+static bst_node *join_right(bst_node *l, bst_node *mid, bst_node *r) {
+    bst_node *c = l->right;
+
+    if (bst_height(c) <= bst_height(r) + 1) {
+        mid->left = c;
+        mid->right = r;
+        bst_update_node(mid);
+
+        if (bst_height(mid) <= bst_height(l->left) + 1) {
+            l->right = mid;
+            bst_update_node(l);
+            return l;
+        }
+
+        l->right = bst_rotate_right(mid);
+        bst_update_node(l);
+        return bst_rotate_left(l);
+    }
+
+    l->right = join_right(c, mid, r);
+    bst_update_node(l);
+
+    return bst_height(l->right) <= bst_height(l->left) + 1
+               ? l
+               : bst_rotate_left(l);
+}
+
+/**
+ * join_left:
+ *      Mirror of join_right for r taller than l.
+ */
+static bst_node *join_left(bst_node *l, bst_node *mid, bst_node *r) {
+    bst_node *c = r->left;
+
+    if (bst_height(c) <= bst_height(l) + 1) {
+        mid->left = l;
+        mid->right = c;
+        bst_update_node(mid);
+
+        if (bst_height(mid) <= bst_height(r->right) + 1) {
+            r->left = mid;
+            bst_update_node(r);
+            return r;
+        }
+
+        r->left = bst_rotate_left(mid);
+        bst_update_node(r);
+        return bst_rotate_right(r);
+    }
+
+    r->left = join_left(l, mid, c);
+    bst_update_node(r);
+
+    return bst_height(r->left) <= bst_height(r->right) + 1
+               ? r
+               : bst_rotate_right(r);
+}
+
+/**
+ * bst_join:
+ *      Join two AVL trees and a detached node, every element of l sorting
+ *      before mid and every element of r after it, into one AVL tree in
+ *      O(|height(l) - height(r)| + 1).
+ */
+bst_node *bst_join(bst_node *l, bst_node *mid, bst_node *r) {
+    if (bst_height(l) > bst_height(r) + 1) {
+        return join_right(l, mid, r);
+    }
+
+    if (bst_height(r) > bst_height(l) + 1) {
+        return join_left(l, mid, r);
+    }
+
+    mid->left = l;
+    mid->right = r;
+    bst_update_node(mid);
+
+    return mid;
+}
+
+/**
+ * bst_split:
+ *      Split a tree around key into the elements before it, stored in
+ *      *lo, and those after it, stored in *hi. Return the detached node
+ *      equal to key, or NULL. O(log n).
+ */
+bst_node *bst_split(bst_node *root, const void *key, comparator cmp,
+                    bst_node **lo, bst_node **hi) {
+    if (!root) {
+        *lo = *hi = NULL;
+        return NULL;
+    }
+
+    bst_node *found, *l = root->left, *r = root->right;
+    result dir = cmp(key, root->data);
+
+    if (dir == EQUAL) {
+        *lo = l;
+        *hi = r;
+        root->left = root->right = NULL;
+        bst_update_node(root);
+        return root;
+    }
+
+    if (dir == LESSER) {
+        found = bst_split(l, key, cmp, lo, hi);
+        *hi = bst_join(*hi, root, r);
+    } else {
+        found = bst_split(r, key, cmp, lo, hi);
+        *lo = bst_join(l, root, *lo);
+    }
+
+    return found;
+}
+
+/**
+ * split_last:
+ *      Detach the largest node of a non-empty tree, leaving the rest in
+ *      *rest, and return it.
+ */
+static bst_node *split_last(bst_node *root, bst_node **rest) {
+    if (!root->right) {
+        *rest = root->left;
+        root->left = NULL;
+        bst_update_node(root);
+        return root;
+    }
+
+    bst_node *l = root->left, *r;
+    bst_node *last = split_last(root->right, &r);
+
+    *rest = bst_join(l, root, r);
+    return last;
+}
+
+/**
+ * join2:
+ *      Join two trees with every element of l before those of r.
+ */
+static bst_node *join2(bst_node *l, bst_node *r) {
+    if (!l) {
+        return r;
+    }
+
+    bst_node *rest;
+    bst_node *mid = split_last(l, &rest);
+
+    return bst_join(rest, mid, r);
+}
+
+/**
+ * run_half:
+ *      Task body for one half of a split operation.
+ */
+static void run_half(void *arg) {
+    set_half *h = arg;
+
+    h->result = h->fn(h->ctx, h->a, h->b);
+}
+
+/**
+ * both_halves:
+ *      Solve fn on (a1, b1) into *r1 and on (a2, b2) into *r2, the first
+ *      on the pool when both are big enough to be worth it.
+ */
+static void both_halves(const set_ctx *c, set_func fn, bst_node *a1,
+                        bst_node *b1, bst_node *a2, bst_node *b2,
+                        bst_node **r1, bst_node **r2) {
+    if (c->parallel && bst_size(a1) + bst_size(b1) >= PARALLEL_CUTOFF &&
+        bst_size(a2) + bst_size(b2) >= PARALLEL_CUTOFF) {
+        set_half first = {c, fn, a1, b1, NULL};
+        bst_task task;
+
+        bst_task_fork(&task, run_half, &first);
+        *r2 = fn(c, a2, b2);
+        bst_task_join(&task);
+        *r1 = first.result;
+        return;
+    }
+
+    *r1 = fn(c, a1, b1);
+    *r2 = fn(c, a2, b2);
+}
+
+/**
+ * set_union:
+ *      Elements in either tree, keeping a's copy of common elements.
+ */
+static bst_node *set_union(const set_ctx *c, bst_node *a, bst_node *b) {
+    if (!a) {
+        return b;
+    }
+    if (!b) {
+        return a;
+    }
+
+    bst_node *lo, *hi, *l, *r;
+    bst_node *dup = bst_split(b, a->data, c->cmp, &lo, &hi);
+    if (dup) {
+        bst_free_node(dup, c->freefn, c->alloc);
+    }
+
+    both_halves(c, set_union, a->left, lo, a->right, hi, &l, &r);
+    return bst_join(l, a, r);
+}
+
+/**
+ * set_intersect:
+ *      Elements in both trees, keeping a's copy.
+ */
+static bst_node *set_intersect(const set_ctx *c, bst_node *a, bst_node *b) {
+    if (!a || !b) {
+        bst_free_subtree(a, c->freefn, c->alloc);
+        bst_free_subtree(b, c->freefn, c->alloc);
+        return NULL;
+    }
+
+    bst_node *lo, *hi, *l, *r;
+    bst_node *dup = bst_split(b, a->data, c->cmp, &lo, &hi);
+
+    both_halves(c, set_intersect, a->left, lo, a->right, hi, &l, &r);
+    if (dup) {
+        bst_free_node(dup, c->freefn, c->alloc);
+        return bst_join(l, a, r);
+    }
+
+    bst_free_node(a, c->freefn, c->alloc);
+    return join2(l, r);
+}
+
+/**
+ * set_difference:
+ *      Elements of a not in b.
+ */
+static bst_node *set_difference(const set_ctx *c, bst_node *a, bst_node *b) {
+    if (!a || !b) {
+        bst_free_subtree(b, c->freefn, c->alloc);
+        return a;
+    }
+
+    bst_node *lo, *hi, *l, *r;
+    bst_node *bl = b->left, *br = b->right;
+    bst_node *found = bst_split(a, b->data, c->cmp, &lo, &hi);
+
+    bst_free_node(b, c->freefn, c->alloc);
+    if (found) {
+        bst_free_node(found, c->freefn, c->alloc);
+    }
+
+    both_halves(c, set_difference, lo, bl, hi, br, &l, &r);
+    return join2(l, r);
+}
+
+/**
+ * set_operation:
+ *      Combine src into dst with fn and leave src empty. Both trees must
+ *      hold the same kind of element and share an allocator, and owned
+ *      string trees the same way of keeping keys.
+ */
+static bool set_operation(bst_tree *dst, bst_tree *src, set_func fn,
+                          const char *caller) {
+    if (dst == src || dst->size != src->size || dst->cmp != src->cmp ||
+        dst->freefn != src->freefn || dst->alloc.alloc != src->alloc.alloc ||
+        dst->alloc.free != src->alloc.free ||
+        dst->alloc.ctx != src->alloc.ctx || !dst->strings != !src->strings ||
+        dst->intern != src->intern) {
+        error_message("%s: trees are not compatible", caller);
+        return false;
+    }
+
+    // Lock in address order so opposite calls cannot deadlock
+    bst_tree *first = dst < src ? dst : src;
+    bst_tree *second = dst < src ? src : dst;
+    tree_write_lock(first);
+    tree_write_lock(second);
+
+    // Pools are not thread safe, only heap nodes are freed in parallel
+    set_ctx c = {dst->cmp, dst->freefn, &dst->alloc,
+                 bst_heap_allocated(&dst->alloc)};
+
+    dst->root = fn(&c, dst->root, src->root);
+    dst->count = bst_size(dst->root);
+    src->root = NULL;
+    src->count = 0;
+
+    // Keys of owned string trees move along with their nodes
+    if (src->strings) {
+        bst_arena_merge(dst->strings, src->strings);
+    }
+
+    tree_unlock(second);
+    tree_unlock(first);
+
+    return true;
+}
+
+/**
+ * bst_union:
+ *      Move the elements of src not already in dst into dst, freeing the
+ *      duplicates, and leave src empty. Return false if the trees do not
+ *      share element size, comparator, free function and allocator.
+ */
+bool bst_union(bst_tree *dst, bst_tree *src) {
+    return set_operation(dst, src, set_union, "bst_union");
+}
+
+/**
+ * bst_intersect:
+ *      Keep only the elements of dst also in src, freeing the rest of
+ *      both, and leave src empty. Return false as for bst_union.
+ */
+bool bst_intersect(bst_tree *dst, bst_tree *src) {
+    return set_operation(dst, src, set_intersect, "bst_intersect");
+}
+
+/**
+ * bst_difference:
+ *      Remove the elements of src from dst, freeing every element of src,
+ *      and leave src empty. Return false as for bst_union.
+ */
+bool bst_difference(bst_tree *dst, bst_tree *src) {
+    return set_operation(dst, src, set_difference, "bst_difference");
+}
@@ -0,0 +1,275 @@
+/**
+ * bst_stream.c - Streaming in order export and import of trees.
+ *
+ * Copyright (c) 2024 Michael Berry
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bst_private.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A stream is a small header followed by the elements in increasing
+// order. Both directions go through a fixed buffer, so neither side ever
+// holds more than the tree itself plus STREAM_BUFFER bytes, and the
+// header's count lets the reader build the balanced shape as elements
+// arrive instead of collecting them first.
+
+#define STREAM_BUFFER 65536
+
+#define STREAM_MAGIC "bststrm\0"
+#define STREAM_ORDER 0x01020304u // reads back swapped on other endians
+
+typedef struct stream_header {
+    char magic[8];
+    uint32_t order;
+    uint32_t unused;
+    uint64_t size;  // element size in bytes
+    uint64_t count; // number of elements that follow
+} stream_header;
+
+// Buffered side of an export
+typedef struct stream_writer {
+    write_func write;
+    void *ctx;
+    unsigned char *buf;
+    size_t used;
+    bool ok; // false once a write failed
+} stream_writer;
+
+// Buffered side of an import
+typedef struct stream_reader {
+    read_func read;
+    void *ctx;
+    unsigned char *buf;
+    size_t pos, len;   // unread bytes are buf[pos] up to buf[len]
+    size_t remaining;  // bytes of the stream not yet in buf
+    size_t size;       // element size in bytes
+    comparator cmp;
+    const bst_allocator *alloc;
+    const void *last;  // element of the previous node built
+    const char *error; // why the import failed, NULL while it has not
+} stream_reader;
+
+/**
+ * flush:
+ *      Hand the buffered bytes to the write callback.
+ */
+static void flush(stream_writer *w) {
+    if (w->ok && w->used) {
+        w->ok = w->write(w->buf, w->used, w->ctx);
+    }
+    w->used = 0;
+}
+
+/**
+ * put:
+ *      Append len bytes to the stream.
+ */
+static void put(stream_writer *w, const void *data, size_t len) {
+    const unsigned char *src = data;
+
+    while (len && w->ok) {
+        size_t n = STREAM_BUFFER - w->used < len ? STREAM_BUFFER - w->used
+                                                 : len;
+        memcpy(w->buf + w->used, src, n);
+        w->used += n;
+        src += n;
+        len -= n;
+        if (w->used == STREAM_BUFFER) {
+            flush(w);
+        }
+    }
+}
+
+/**
+ * bst_tree_export:
+ *      Write the elements of tree in increasing order to write, which is
+ *      called with ctx and chunks of at most 64 KiB. Elements are written
+ *      byte for byte, so only flat elements can be sent to another
+ *      process, and trees owning their string keys are refused. A
+ *      concurrent tree stays read locked until the export returns.
+ *      Return false once write fails, nothing more is written.
+ */
+bool bst_tree_export(const bst_tree *tree, write_func write, void *ctx) {
+    if (tree->strings || tree->intern) {
+        error_message("bst_tree_export: tree owns its string keys");
+        return false;
+    }
+
+    stream_writer w = {write, ctx, malloc(STREAM_BUFFER), 0, true};
+    if (!w.buf) {
+        error_syscall("Unable to allocate memory for bst_tree_export");
+    }
+
+    tree_read_lock(tree);
+
+    stream_header header = {STREAM_MAGIC, STREAM_ORDER, 0, tree->size,
+                            tree->count};
+    put(&w, &header, sizeof(header));
+
+    bst_iter it;
+    const void *data;
+
+    bst_iter_init(&it, tree);
+    while (w.ok && (data = bst_iter_next(&it))) {
+        put(&w, data, tree->size);
+    }
+    flush(&w);
+
+    tree_unlock(tree);
+    free(w.buf);
+
+    return w.ok;
+}
+
+/**
+ * take:
+ *      Read the next len bytes of the stream into dst. Never asks read
+ *      for bytes past the end of the tree, so whatever follows it in the
+ *      stream is left for the caller.
+ */
+static bool take(stream_reader *r, void *dst, size_t len) {
+    unsigned char *out = dst;
+
+    while (len) {
+        if (r->pos == r->len) {
+            size_t want = r->remaining < STREAM_BUFFER ? r->remaining
+                                                       : STREAM_BUFFER;
+            size_t got = want ? r->read(r->buf, want, r->ctx) : 0;
+            if (!got) {
+                r->error = "stream ended early";
+                return false;
+            }
+            r->pos = 0;
+            r->len = got < want ? got : want;
+            r->remaining -= r->len;
+        }
+
+        size_t n = r->len - r->pos < len ? r->len - r->pos : len;
+        memcpy(out, r->buf + r->pos, n);
+        r->pos += n;
+        out += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/**
+ * import_range:
+ *      Build a balanced subtree from the next n elements of the stream.
+ *      The left half is built first, so elements are consumed in order
+ *      straight into their nodes. On failure nothing built is kept.
+ */
+static bst_node *import_range(stream_reader *r, size_t n) {
+    if (!n || r->error) {
+        return NULL;
+    }
+
+    bst_node *left = import_range(r, n / 2);
+    if (r->error) {
+        bst_free_subtree(left, NULL, r->alloc);
+        return NULL;
+    }
+
+    bst_node *node = r->alloc->alloc(r->alloc->ctx,
+                                     sizeof(bst_node) + r->size);
+    if (!node) {
+        error_syscall("Unable to allocate memory for bst_node");
+    }
+    node->left = left;
+    node->right = NULL;
+    node->height = node->count = 1;
+
+    if (take(r, node->data, r->size) && r->last &&
+        r->cmp(r->last, node->data) != LESSER) {
+        r->error = "elements are not in increasing order";
+    }
+    if (r->error) {
+        bst_free_subtree(node, NULL, r->alloc);
+        return NULL;
+    }
+    r->last = node->data;
+
+    node->right = import_range(r, n - n / 2 - 1);
+    if (r->error) {
+        bst_free_subtree(node, NULL, r->alloc);
+        return NULL;
+    }
+
+    // The left half is never the smaller one
+    node->height = bst_height(left) + 1;
+    node->count = n;
+
+    return node;
+}
+
+/**
+ * bst_tree_import:
+ *      Fill an empty tree from a stream written by bst_tree_export for
+ *      the same element size, pulling it through read with ctx. read is
+ *      asked for at most 64 KiB at a time and never for bytes past the
+ *      end of the tree, so a stream may carry other data afterwards. The
+ *      tree is built balanced in O(n) time as the elements arrive.
+ *      Return false if the tree is not empty, owns its string keys, or
+ *      the stream is short, corrupt or out of order, the tree is left
+ *      empty.
+ */
+bool bst_tree_import(bst_tree *tree, read_func read, void *ctx) {
+    stream_reader r = {read, ctx, malloc(STREAM_BUFFER), 0, 0,
+                       sizeof(stream_header), tree->size, tree->cmp,
+                       &tree->alloc, NULL, NULL};
+    if (!r.buf) {
+        error_syscall("Unable to allocate memory for bst_tree_import");
+    }
+
+    tree_write_lock(tree);
+
+    stream_header header;
+    if (tree->strings || tree->intern) {
+        // Imported keys would point into another tree's strings
+        r.error = "tree owns its string keys";
+    } else if (tree->root) {
+        r.error = "tree is not empty";
+    } else if (take(&r, &header, sizeof(header))) {
+        if (memcmp(header.magic, STREAM_MAGIC, sizeof(header.magic)) ||
+            header.order != STREAM_ORDER || header.size != tree->size ||
+            header.count > SIZE_MAX / tree->size) {
+            r.error = "stream does not hold elements of this tree";
+        } else {
+            r.remaining = header.count * tree->size;
+            tree->root = import_range(&r, header.count);
+            tree->count = r.error ? 0 : header.count;
+        }
+    }
+
+    tree_unlock(tree);
+    free(r.buf);
+
+    if (r.error) {
+        error_message("bst_tree_import: %s", r.error);
+        return false;
+    }
+
+    return true;
+}
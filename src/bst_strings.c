@@ -0,0 +1,292 @@
+/**
+ * bst_strings.c - String arenas and intern tables for owned string keys.
+ *
+ * Copyright (c) 2024 Michael Berry
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bst_private.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Owned string trees copy every key into an arena, a list of large
+// chunks filled front to back. Keys of one tree end up next to each other
+// in memory, there is no allocation per key, and everything is released
+// at once when the tree goes. An intern table keeps one copy of each
+// distinct string in its own arena, so trees sharing it also share keys.
+
+#define ARENA_CHUNK 65536
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used, cap;
+    char data[];
+} arena_chunk;
+
+struct bst_arena {
+    arena_chunk *head; // chunk being filled, the rest are full
+};
+
+// Intern table slot, str is NULL when the slot is free
+typedef struct intern_slot {
+    const char *str;
+    uint64_t hash;
+    size_t len;
+} intern_slot;
+
+struct bst_intern {
+    bst_arena *arena;
+    intern_slot *slots;
+    size_t cap;   // power of two
+    size_t count; // slots in use
+    pthread_mutex_t lock;
+};
+
+/**
+ * bst_arena_new:
+ *      Create an empty string arena.
+ */
+bst_arena *bst_arena_new(void) {
+    bst_arena *arena = calloc(1, sizeof(bst_arena));
+    if (!arena) {
+        error_syscall("Unable to allocate memory for bst_arena");
+    }
+
+    return arena;
+}
+
+/**
+ * bst_arena_delete:
+ *      Free an arena and every string copied into it.
+ */
+void bst_arena_delete(bst_arena *arena) {
+    if (!arena) {
+        return;
+    }
+
+    while (arena->head) {
+        arena_chunk *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+    free(arena);
+}
+
+/**
+ * bst_arena_strdup:
+ *      Copy the len bytes of str and a terminator into the arena.
+ */
+const char *bst_arena_strdup(bst_arena *arena, const char *str, size_t len) {
+    arena_chunk *chunk = arena->head;
+
+    if (!chunk || chunk->cap - chunk->used <= len) {
+        size_t cap = len < ARENA_CHUNK / 4 ? ARENA_CHUNK : len + 1;
+
+        // A long string gets a chunk of its own behind the current one,
+        // so the space left in that one is not wasted
+        chunk = malloc(sizeof(arena_chunk) + cap);
+        if (!chunk) {
+            error_syscall("Unable to allocate memory for bst_arena");
+        }
+        chunk->used = 0;
+        chunk->cap = cap;
+        if (cap != ARENA_CHUNK && arena->head) {
+            chunk->next = arena->head->next;
+            arena->head->next = chunk;
+        } else {
+            chunk->next = arena->head;
+            arena->head = chunk;
+        }
+    }
+
+    char *copy = chunk->data + chunk->used;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    chunk->used += len + 1;
+
+    return copy;
+}
+
+/**
+ * bst_arena_merge:
+ *      Move every string of src into dst, leaving src empty. Strings keep
+ *      their addresses.
+ */
+void bst_arena_merge(bst_arena *dst, bst_arena *src) {
+    arena_chunk **tail = &src->head;
+
+    if (!src->head) {
+        return;
+    }
+
+    // Keep filling the current chunk of dst, the others are full
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    if (dst->head) {
+        *tail = dst->head->next;
+        dst->head->next = src->head;
+    } else {
+        dst->head = src->head;
+    }
+
+    src->head = NULL;
+}
+
+/**
+ * hash_str:
+ *      64 bit FNV-1a hash of len bytes of str.
+ */
+static uint64_t hash_str(const char *str, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * bst_intern_new:
+ *      Create an empty intern table. It may be shared by several trees
+ *      and threads, and must outlive every tree using it.
+ */
+bst_intern *bst_intern_new(void) {
+    bst_intern *intern = calloc(1, sizeof(bst_intern));
+    if (!intern) {
+        error_syscall("Unable to allocate memory for bst_intern");
+    }
+
+    intern->arena = bst_arena_new();
+    intern->cap = 64;
+    intern->slots = calloc(intern->cap, sizeof(intern_slot));
+    if (!intern->slots) {
+        error_syscall("Unable to allocate memory for bst_intern");
+    }
+
+    int err = pthread_mutex_init(&intern->lock, NULL);
+    if (err) {
+        errno = err;
+        error_syscall("Unable to initialise bst_intern lock");
+    }
+
+    return intern;
+}
+
+/**
+ * bst_intern_delete:
+ *      Free an intern table and all of its strings.
+ */
+void bst_intern_delete(bst_intern *intern) {
+    if (!intern) {
+        return;
+    }
+
+    pthread_mutex_destroy(&intern->lock);
+    bst_arena_delete(intern->arena);
+    free(intern->slots);
+    free(intern);
+}
+
+/**
+ * intern_grow:
+ *      Double the slots of the table, keeping it at most half full.
+ */
+static void intern_grow(bst_intern *intern) {
+    size_t cap = 2 * intern->cap;
+    intern_slot *slots = calloc(cap, sizeof(intern_slot));
+    if (!slots) {
+        error_syscall("Unable to allocate memory for bst_intern");
+    }
+
+    for (size_t i = 0; i < intern->cap; i++) {
+        intern_slot *old = &intern->slots[i];
+        if (!old->str) {
+            continue;
+        }
+
+        size_t k = old->hash & (cap - 1);
+        while (slots[k].str) {
+            k = (k + 1) & (cap - 1);
+        }
+        slots[k] = *old;
+    }
+
+    free(intern->slots);
+    intern->slots = slots;
+    intern->cap = cap;
+}
+
+/**
+ * bst_intern_str_len:
+ *      Return the single copy of the len bytes at str kept by the table,
+ *      adding one first if there is none.
+ */
+const char *bst_intern_str_len(bst_intern *intern, const char *str,
+                               size_t len) {
+    uint64_t hash = hash_str(str, len);
+
+    pthread_mutex_lock(&intern->lock);
+
+    size_t k = hash & (intern->cap - 1);
+    for (intern_slot *slot; (slot = &intern->slots[k])->str;
+         k = (k + 1) & (intern->cap - 1)) {
+        if (slot->hash == hash && slot->len == len &&
+            !memcmp(slot->str, str, len)) {
+            pthread_mutex_unlock(&intern->lock);
+            return slot->str;
+        }
+    }
+
+    const char *copy = bst_arena_strdup(intern->arena, str, len);
+    intern->slots[k] = (intern_slot){copy, hash, len};
+    if (++intern->count > intern->cap / 2) {
+        intern_grow(intern);
+    }
+
+    pthread_mutex_unlock(&intern->lock);
+
+    return copy;
+}
+
+/**
+ * bst_intern_str:
+ *      Return the single copy of str kept by the table, adding one first
+ *      if there is none.
+ */
+const char *bst_intern_str(bst_intern *intern, const char *str) {
+    return bst_intern_str_len(intern, str, strlen(str));
+}
+
+/**
+ * bst_intern_size:
+ *      Number of distinct strings in the table.
+ */
+size_t bst_intern_size(bst_intern *intern) {
+    pthread_mutex_lock(&intern->lock);
+    size_t count = intern->count;
+    pthread_mutex_unlock(&intern->lock);
+
+    return count;
+}
@@ -0,0 +1,167 @@
+/**
+ * bst_task.c - Fork join thread pool behind the parallel tree operations.
+ *
+ * Copyright (c) 2024 Michael Berry
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bst_private.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// One pool serves the whole process and starts on first use with a worker
+// per CPU besides the caller. Forked tasks go on a shared stack. A task
+// joined before any worker picks it up is taken back and run by the
+// joining thread, so a join only waits for tasks that are running and
+// nested fork join cannot deadlock however few workers there are.
+
+static struct {
+    pthread_once_t once;
+    pthread_mutex_t lock;
+    pthread_cond_t work; // signalled when a task is queued
+    pthread_cond_t done; // broadcast when a task finishes
+    bst_task **queue;    // queued tasks, newest last
+    size_t len;
+    size_t cap;
+    size_t workers;
+} pool = {PTHREAD_ONCE_INIT, PTHREAD_MUTEX_INITIALIZER,
+          PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0};
+
+/**
+ * worker:
+ *      Pool thread body, run queued tasks forever.
+ */
+static void *worker(void *arg __attribute__((unused))) {
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (!pool.len) {
+            pthread_cond_wait(&pool.work, &pool.lock);
+        }
+
+        bst_task *task = pool.queue[--pool.len];
+        task->state = TASK_RUNNING;
+        pthread_mutex_unlock(&pool.lock);
+
+        task->fn(task->arg);
+
+        pthread_mutex_lock(&pool.lock);
+        task->state = TASK_DONE;
+        pthread_cond_broadcast(&pool.done);
+    }
+
+    return NULL;
+}
+
+/**
+ * start_pool:
+ *      Start the workers, once per process.
+ */
+static void start_pool(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t thread;
+
+    for (long i = 1; i < cpus; i++) {
+        int err = pthread_create(&thread, NULL, worker, NULL);
+        if (err) {
+            errno = err;
+            error_syscall("Unable to start bst worker thread");
+        }
+        pthread_detach(thread);
+        pool.workers++;
+    }
+}
+
+/**
+ * bst_task_workers:
+ *      Number of pool threads besides the caller, 0 means forked tasks
+ *      run inline.
+ */
+size_t bst_task_workers(void) {
+    pthread_once(&pool.once, start_pool);
+    return pool.workers;
+}
+
+/**
+ * bst_task_fork:
+ *      Queue fn(arg) to run on the pool. task must stay alive until
+ *      bst_task_join returns.
+ */
+void bst_task_fork(bst_task *task, void (*fn)(void *), void *arg) {
+    task->fn = fn;
+    task->arg = arg;
+
+    if (!bst_task_workers()) {
+        fn(arg);
+        task->state = TASK_DONE;
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.len == pool.cap) {
+        size_t cap = pool.cap ? 2 * pool.cap : 64;
+        bst_task **queue = realloc(pool.queue, cap * sizeof(bst_task *));
+        if (!queue) {
+            error_syscall("Unable to grow bst task queue");
+        }
+        pool.queue = queue;
+        pool.cap = cap;
+    }
+
+    task->state = TASK_QUEUED;
+    pool.queue[pool.len++] = task;
+    pthread_cond_signal(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * bst_task_join:
+ *      Wait for a forked task, running it here if no worker has started
+ *      it yet.
+ */
+void bst_task_join(bst_task *task) {
+    if (!pool.workers) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if (task->state == TASK_QUEUED) {
+        // Usually the newest entry, as joins mirror forks
+        size_t i = pool.len;
+        while (pool.queue[--i] != task) {
+        }
+        pool.len--;
+        for (; i < pool.len; i++) {
+            pool.queue[i] = pool.queue[i + 1];
+        }
+        task->state = TASK_RUNNING;
+        pthread_mutex_unlock(&pool.lock);
+
+        task->fn(task->arg);
+        task->state = TASK_DONE;
+        return;
+    }
+
+    while (task->state != TASK_DONE) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,479 @@
+/** test_bst_concurrent.c - Test of trees shared between threads.
+
+Copyright (c) 2024 Michael Berry
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "../include/bst.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define KEY_RANGE 4096
+#define READERS 4
+#define WRITES 20000
+
+// Odd keys stay in the tree throughout, the writer churns the even ones
+typedef struct shared_tree {
+    bst_tree *tree;
+    int done;
+} shared_tree;
+
+// RCU tree element, payload is freed by the tree once no reader can see it
+typedef struct rcu_elem {
+    int key;
+    int *payload;
+} rcu_elem;
+
+typedef struct shared_rcu {
+    bst_rcu *tree;
+    int done;
+} shared_rcu;
+
+uint64_t next_random(uint64_t *);
+void *reader(void *);
+void *writer(void *);
+void *saver(void *);
+void concurrent_tree_test(void);
+result compare_rcu_elem(const void *, const void *);
+void free_rcu_elem(void *);
+rcu_elem make_rcu_elem(int);
+size_t check_rcu_avl(bst_node *, const int *, const int *);
+void *rcu_reader(void *);
+void *rcu_writer(void *);
+void rcu_tree_test(void);
+
+// Number of payloads freed by free_rcu_elem
+static size_t payloads_freed;
+
+int main() {
+    signal(SIGSEGV, sig_seg);
+    concurrent_tree_test();
+    rcu_tree_test();
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * next_random:
+ *      xorshift64* generator, reproducible across runs.
+ */
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * reader:
+ *      Query the shared tree until the writer finishes, checking that the
+ *      odd keys are always found and that nothing torn is ever returned.
+ */
+void *reader(void *arg) {
+    shared_tree *shared = arg;
+    uint64_t seed = (uint64_t)(uintptr_t)&seed | 1;
+    size_t rounds = 0;
+    bst_iter it;
+
+    bst_iter_init(&it, shared->tree);
+    while (!__atomic_load_n(&shared->done, __ATOMIC_ACQUIRE) || rounds < 2) {
+        for (int i = 0; i < 256; i++) {
+            int key = (int)(next_random(&seed) % KEY_RANGE);
+            const int *got;
+
+            // Odd keys are never removed, so reading them needs no pin
+            got = bst_tree_lookup(shared->tree, &key);
+            if (key & 1 && (!got || *got != key)) {
+                error_quit("lookup of %d returned %d", key, got ? *got : -1);
+            }
+
+            // Pin the tree so the element found can still be read
+            bst_tree_read_lock(shared->tree);
+            got = bst_iter_seek(&it, &key);
+            if (!got || *got < key || *got > key + 1) {
+                error_quit("seek to %d returned %d", key, got ? *got : -1);
+            }
+            bst_tree_read_unlock(shared->tree);
+        }
+
+        // Walk the whole tree while pinning it
+        const int *got;
+        int last = -1;
+        size_t odd = 0;
+
+        bst_tree_read_lock(shared->tree);
+        bst_iter_init(&it, shared->tree);
+        while ((got = bst_iter_next(&it))) {
+            if (*got <= last) {
+                error_quit("iteration went from %d to %d", last, *got);
+            }
+            odd += *got & 1;
+            last = *got;
+        }
+        bst_tree_read_unlock(shared->tree);
+
+        if (odd != KEY_RANGE / 2) {
+            error_quit("iteration saw %zu odd keys", odd);
+        }
+
+        // Snapshots copy the tree under the lock, so they are never torn
+        bst_frozen *frozen = bst_freeze(shared->tree);
+        bst_frozen_int *ints = bst_freeze_int(shared->tree);
+        odd = 0;
+        for (int key = 1; key < KEY_RANGE; key += 2) {
+            odd += bst_frozen_lookup(frozen, &key) != NULL &&
+                   bst_frozen_int_contains(ints, key);
+        }
+        if (!ints || odd != KEY_RANGE / 2 ||
+            bst_frozen_size(frozen) < KEY_RANGE / 2) {
+            error_quit("snapshot saw %zu odd keys", odd);
+        }
+        bst_frozen_int_delete(ints);
+        bst_frozen_delete(frozen);
+        rounds++;
+    }
+
+    return NULL;
+}
+
+/**
+ * writer:
+ *      Insert and remove random even keys, sometimes in batches.
+ */
+void *writer(void *arg) {
+    shared_tree *shared = arg;
+    uint64_t seed = 42;
+
+    for (int i = 0; i < WRITES; i++) {
+        uint64_t r = next_random(&seed);
+        int key = (int)((r >> 8) % (KEY_RANGE / 2)) * 2;
+
+        if (r & 1) {
+            bst_tree_insert(shared->tree, &key);
+        } else if (r & 2) {
+            bst_tree_remove(shared->tree, &key);
+        } else {
+            int batch[8];
+            for (int j = 0; j < 8; j++) {
+                batch[j] = (key + 2 * j) % KEY_RANGE;
+            }
+            bst_insert_batch(shared->tree, batch, 8);
+        }
+    }
+
+    __atomic_store_n(&shared->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * saver:
+ *      Save the shared tree to a file until the writer finishes, checking
+ *      every file reopens with all the odd keys.
+ */
+void *saver(void *arg) {
+    shared_tree *shared = arg;
+    char path[] = "/tmp/test_bst_XXXXXX";
+    size_t rounds = 0;
+
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        error_syscall("Unable to create %s", path);
+    }
+    close(fd);
+
+    while (!__atomic_load_n(&shared->done, __ATOMIC_ACQUIRE) || rounds < 2) {
+        if (!bst_save(shared->tree, path)) {
+            error_quit("unable to save the shared tree");
+        }
+
+        bst_frozen *f = bst_mmap_open(path, compare_int);
+        if (!f) {
+            error_quit("saved a file that does not reopen");
+        }
+        for (int key = 1; key < KEY_RANGE; key += 2) {
+            if (!bst_frozen_lookup(f, &key)) {
+                error_quit("saved file is missing %d", key);
+            }
+        }
+        bst_frozen_delete(f);
+        rounds++;
+    }
+
+    unlink(path);
+    return NULL;
+}
+
+/**
+ * concurrent_tree_test:
+ *      Run readers against a writer on one concurrent tree.
+ */
+void concurrent_tree_test(void) {
+    int odd[KEY_RANGE / 2];
+    pthread_t threads[READERS + 2];
+    shared_tree shared = {NULL, 0};
+
+    for (int i = 0; i < KEY_RANGE / 2; i++) {
+        odd[i] = 2 * i + 1;
+    }
+
+    shared.tree = bst_tree_new(sizeof(int), compare_int, NULL);
+    bst_tree_make_concurrent(shared.tree);
+    bst_tree_build_from_sorted(shared.tree, odd, KEY_RANGE / 2);
+
+    printf("Running %d readers against %d writes\n", READERS, WRITES);
+    for (int i = 0; i < READERS; i++) {
+        if (pthread_create(&threads[i], NULL, reader, &shared)) {
+            error_quit("Unable to start reader %d", i);
+        }
+    }
+    if (pthread_create(&threads[READERS], NULL, writer, &shared)) {
+        error_quit("Unable to start writer");
+    }
+    if (pthread_create(&threads[READERS + 1], NULL, saver, &shared)) {
+        error_quit("Unable to start saver");
+    }
+
+    for (int i = 0; i <= READERS + 1; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    size_t size = bst_tree_size(shared.tree);
+    if (bst_range_count(shared.tree, NULL, NULL) != size ||
+        size < KEY_RANGE / 2) {
+        error_quit("tree holds %zu elements after the run", size);
+    }
+
+    bst_tree_delete(shared.tree, NULL);
+}
+
+/**
+ * compare_rcu_elem:
+ *      Order RCU tree elements by key.
+ */
+result compare_rcu_elem(const void *a, const void *b) {
+    return compare_int(&((const rcu_elem *)a)->key,
+                       &((const rcu_elem *)b)->key);
+}
+
+/**
+ * free_rcu_elem:
+ *      Free the payload of an element that left the tree.
+ */
+void free_rcu_elem(void *data) {
+    rcu_elem *e = data;
+
+    if (*e->payload != e->key) {
+        error_quit("payload of %d was overwritten", e->key);
+    }
+    free(e->payload);
+    __atomic_fetch_add(&payloads_freed, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * make_rcu_elem:
+ *      Element for key with a freshly allocated payload.
+ */
+rcu_elem make_rcu_elem(int key) {
+    rcu_elem e = {key, malloc(sizeof(int))};
+    if (!e.payload) {
+        error_syscall("Unable to allocate payload");
+    }
+    *e.payload = key;
+
+    return e;
+}
+
+/**
+ * check_rcu_avl:
+ *      Verify order, heights, balance, subtree sizes and payloads of a
+ *      version of the tree and return its height.
+ */
+size_t check_rcu_avl(bst_node *node, const int *lo, const int *hi) {
+    if (!node) {
+        return 0;
+    }
+
+    const rcu_elem *e = (const rcu_elem *)node->data;
+    if ((lo && e->key <= *lo) || (hi && e->key >= *hi) ||
+        *e->payload != e->key) {
+        error_quit("key %d is out of order or torn", e->key);
+    }
+
+    size_t l = check_rcu_avl(node->left, lo, &e->key);
+    size_t r = check_rcu_avl(node->right, &e->key, hi);
+    if (node->height != (l > r ? l : r) + 1 || l > r + 1 || r > l + 1 ||
+        node->count != bst_size(node->left) + 1 + bst_size(node->right)) {
+        error_quit("key %d breaks the AVL invariants", e->key);
+    }
+
+    return node->height;
+}
+
+/**
+ * rcu_reader:
+ *      Read the shared tree without locks until the writer finishes, the
+ *      odd keys must always be found and every version must be valid.
+ */
+void *rcu_reader(void *arg) {
+    shared_rcu *shared = arg;
+    bst_rcu_reader *r = bst_rcu_register(shared->tree);
+    uint64_t seed = (uint64_t)(uintptr_t)&seed | 1;
+    size_t rounds = 0;
+
+    while (!__atomic_load_n(&shared->done, __ATOMIC_ACQUIRE) || rounds < 2) {
+        bst_rcu_read_lock(r);
+        for (int i = 0; i < 64; i++) {
+            rcu_elem key = {(int)(next_random(&seed) % KEY_RANGE), NULL};
+            const rcu_elem *got = bst_rcu_lookup(shared->tree, &key);
+
+            if ((key.key & 1 && !got) ||
+                (got && (got->key != key.key || *got->payload != key.key))) {
+                error_quit("rcu lookup of %d is wrong", key.key);
+            }
+        }
+
+        if (rounds % 16 == 0) {
+            check_rcu_avl(bst_rcu_root(shared->tree), NULL, NULL);
+        }
+        bst_rcu_read_unlock(r);
+        rounds++;
+    }
+
+    bst_rcu_unregister(r);
+    return NULL;
+}
+
+/**
+ * rcu_writer:
+ *      Insert and remove random even keys.
+ */
+void *rcu_writer(void *arg) {
+    shared_rcu *shared = arg;
+    uint64_t seed = 7;
+
+    for (int i = 0; i < WRITES; i++) {
+        uint64_t r = next_random(&seed);
+        int key = (int)((r >> 8) % (KEY_RANGE / 2)) * 2;
+
+        if (r & 1) {
+            rcu_elem e = make_rcu_elem(key);
+            if (!bst_rcu_insert(shared->tree, &e)) {
+                free(e.payload);
+            }
+        } else {
+            rcu_elem e = {key, NULL};
+            bst_rcu_remove(shared->tree, &e);
+        }
+    }
+
+    __atomic_store_n(&shared->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * rcu_tree_test:
+ *      Check single threaded updates against a reference, then run lock
+ *      free readers against a writer and check every payload is freed
+ *      exactly once.
+ */
+void rcu_tree_test(void) {
+    bool present[KEY_RANGE] = {false};
+    shared_rcu shared = {bst_rcu_new(sizeof(rcu_elem), compare_rcu_elem,
+                                     free_rcu_elem),
+                         0};
+    bst_rcu_reader *r = bst_rcu_register(shared.tree);
+    uint64_t seed = 3;
+    size_t removed = 0, count = 0;
+
+    printf("Running %d single threaded rcu operations\n", WRITES);
+    for (int i = 0; i < WRITES; i++) {
+        uint64_t x = next_random(&seed);
+        int key = (int)((x >> 8) % KEY_RANGE);
+
+        if ((x & 0xff) >= (count * 256) / KEY_RANGE) {
+            rcu_elem e = make_rcu_elem(key);
+            if (bst_rcu_insert(shared.tree, &e) == present[key]) {
+                error_quit("rcu insert of %d reported the wrong result", key);
+            }
+            if (present[key]) {
+                free(e.payload);
+            }
+            count += !present[key];
+            present[key] = true;
+        } else {
+            rcu_elem e = {key, NULL};
+            if (bst_rcu_remove(shared.tree, &e) != present[key]) {
+                error_quit("rcu remove of %d reported the wrong result", key);
+            }
+            removed += present[key];
+            count -= present[key];
+            present[key] = false;
+        }
+
+        bst_rcu_read_lock(r);
+        check_rcu_avl(bst_rcu_root(shared.tree), NULL, NULL);
+        rcu_elem e = {key, NULL};
+        if ((bst_rcu_lookup(shared.tree, &e) != NULL) != present[key] ||
+            bst_rcu_size(shared.tree) != count) {
+            error_quit("rcu tree disagrees with the reference at %d", key);
+        }
+        bst_rcu_read_unlock(r);
+    }
+
+    // With no reader inside a section two grace periods free everything
+    bst_rcu_synchronize(shared.tree);
+    bst_rcu_synchronize(shared.tree);
+    if (__atomic_load_n(&payloads_freed, __ATOMIC_RELAXED) != removed) {
+        error_quit("%zu payloads freed for %zu removals", payloads_freed,
+                   removed);
+    }
+    bst_rcu_unregister(r);
+
+    // Odd keys only, then readers against the writer
+    for (int k = 0; k < KEY_RANGE; k++) {
+        rcu_elem e = {k, NULL};
+        if (k & 1 && !present[k]) {
+            e = make_rcu_elem(k);
+            bst_rcu_insert(shared.tree, &e);
+        } else if (!(k & 1) && present[k]) {
+            bst_rcu_remove(shared.tree, &e);
+        }
+    }
+
+    pthread_t threads[READERS + 1];
+    printf("Running %d rcu readers against %d writes\n", READERS, WRITES);
+    for (int i = 0; i < READERS; i++) {
+        if (pthread_create(&threads[i], NULL, rcu_reader, &shared)) {
+            error_quit("Unable to start reader %d", i);
+        }
+    }
+    if (pthread_create(&threads[READERS], NULL, rcu_writer, &shared)) {
+        error_quit("Unable to start writer");
+    }
+    for (int i = 0; i <= READERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    bst_rcu_delete(shared.tree, NULL);
+}
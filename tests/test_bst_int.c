@@ -29,10 +29,12 @@ SOFTWARE.
 #include <stdlib.h>
 
 void int_bst_test();
+void pool_bst_test();
 
 int main() {
     signal(SIGSEGV, sig_seg);
     int_bst_test();
+    pool_bst_test();
     exit(EXIT_SUCCESS);
 }
 
@@ -85,6 +87,11 @@ void int_bst_test() {
         printf("Not Found\n\n");
     }
 
+    temp = bst_floor(root, (int *)50, compare_int);
+    printf("Largest value <= 50: %d\n", temp ? *(int *)temp->data : -1);
+    temp = bst_ceil(root, (int *)50, compare_int);
+    printf("Smallest value >= 50: %d\n\n", temp ? *(int *)temp->data : -1);
+
     printf("The size of the tree is %zu\n\n", bst_size(root));
     printf("Maximum depth of tree is %zu\n\n", bst_max_depth(root));
 
@@ -93,3 +100,67 @@ void int_bst_test() {
     printf("\n\n");
     fflush(stdout);
 }
+
+void pool_bst_test() {
+    size_t size = sizeof(int);
+    intptr_t i, limit = 1000;
+    bst_pool *pool = bst_pool_new(size, 64, true);
+    bst_allocator alloc = bst_pool_allocator(pool);
+    bst_node *root = NULL;
+
+    printf("Inserting %zd values into a pooled tree\n", (ssize_t)limit);
+    for (i = 0; i < limit; i++) {
+        root = bst_insert_alloc(root, size, (int *)i, compare_int, &alloc);
+    }
+
+    printf("Removing every even value\n");
+    for (i = 0; i < limit; i += 2) {
+        root = bst_remove_node_alloc(root, (int *)i, compare_int, NULL, &alloc);
+    }
+
+    printf("Reinserting every even value\n");
+    for (i = 0; i < limit; i += 2) {
+        root = bst_insert_alloc(root, size, (int *)i, compare_int, &alloc);
+    }
+
+    if (!bst_is_bst(root, compare_int) || bst_size(root) != (size_t)limit) {
+        error_quit("pooled tree is corrupt");
+    }
+    printf("The size of the pooled tree is %zu\n", bst_size(root));
+
+    printf("Releasing pooled tree\n\n");
+    bst_delete_tree_alloc(root, NULL, NULL, &alloc);
+    bst_pool_delete(pool);
+
+    // A shared pool keeps one tree's nodes when the other is deleted
+    pool = bst_pool_new(size, 64, false);
+    alloc = bst_pool_allocator(pool);
+    bst_tree *kept = bst_tree_new_alloc(size, compare_int, NULL, &alloc);
+    bst_tree *dropped = bst_tree_new_alloc(size, compare_int, NULL, &alloc);
+
+    printf("Sharing a pool between two trees\n");
+    for (i = 0; i < limit; i++) {
+        int key = (int)i;
+        bst_tree_insert(i % 2 ? kept : dropped, &key);
+    }
+    bst_tree_delete(dropped, NULL);
+
+    // Reused slots must come from the deleted tree only
+    for (i = 0; i < limit; i += 2) {
+        int key = (int)(limit + i);
+        bst_tree_insert(kept, &key);
+    }
+    for (i = 1; i < limit; i += 2) {
+        int key = (int)i;
+        if (!bst_tree_lookup(kept, &key)) {
+            error_quit("shared pool lost %d", key);
+        }
+    }
+    if (!bst_is_bst(bst_tree_root(kept), compare_int) ||
+        bst_tree_size(kept) != (size_t)limit) {
+        error_quit("tree sharing a pool is corrupt");
+    }
+
+    bst_tree_delete(kept, NULL);
+    bst_pool_delete(pool);
+}
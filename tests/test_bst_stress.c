@@ -0,0 +1,1468 @@
+/** test_bst_stress.c - Randomized insert and remove checking AVL invariants.
+
+Copyright (c) 2024 Michael Berry
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "../include/bst.h"
+
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define KEY_RANGE 1024
+#define OPERATIONS 20000
+
+typedef struct range_collector {
+    int keys[KEY_RANGE];
+    size_t count;
+    size_t limit;
+} range_collector;
+
+// Reduction checking that elements arrive in order
+typedef struct order_summary {
+    long long sum;
+    size_t count;
+    int first;
+    int last;
+    bool sorted;
+} order_summary;
+
+uint64_t next_random(uint64_t *);
+size_t check_avl(bst_node *, const int *, const int *);
+void check_tree(bst_node *, const bool *);
+void check_bounds(const bst_tree *, const bool *);
+void check_order_statistics(const bst_tree *, const bool *);
+visit_result collect(void *, void *);
+void check_ranges(const bst_tree *, const bool *, uint64_t);
+void check_iterators(const bst_tree *, const bool *, uint64_t);
+void check_batches(bst_tree *, bool *);
+void check_frozen(const bst_tree *, uint64_t);
+void check_snapshot(const bst_tree *, const bst_frozen *, uint64_t);
+void check_frozen_int(const bst_tree *);
+void tree_stress_test(uint64_t);
+void node_stress_test(uint64_t);
+void build_test(uint64_t);
+void compact_stress_test(uint64_t);
+void frozen_int_extremes_test(void);
+void split_join_test(uint64_t);
+void set_ops_test(uint64_t);
+void parallel_test(void);
+void level_order_test(uint64_t);
+void degenerate_delete_test(void);
+void save_load_test(uint64_t);
+void stream_test(uint64_t);
+void context_test(uint64_t);
+
+int main() {
+    signal(SIGSEGV, sig_seg);
+    tree_stress_test(1);
+    node_stress_test(2);
+    build_test(3);
+    compact_stress_test(4);
+    frozen_int_extremes_test();
+    split_join_test(5);
+    set_ops_test(6);
+    parallel_test();
+    level_order_test(7);
+    degenerate_delete_test();
+    save_load_test(8);
+    stream_test(9);
+    context_test(10);
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * next_random:
+ *      xorshift64* generator, reproducible across runs.
+ */
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * check_avl:
+ *      Verify order, stored heights and balance factors of a subtree
+ *      whose keys must lie strictly between lo and hi (NULL for no
+ *      bound) and return its height.
+ */
+size_t check_avl(bst_node *node, const int *lo, const int *hi) {
+    if (!node) {
+        return 0;
+    }
+
+    const int *key = (const int *)node->data;
+    if ((lo && *key <= *lo) || (hi && *key >= *hi)) {
+        error_quit("key %d is out of order", *key);
+    }
+
+    size_t l = check_avl(node->left, lo, key);
+    size_t r = check_avl(node->right, key, hi);
+    size_t height = (l > r ? l : r) + 1;
+
+    if (node->height != height) {
+        error_quit("key %d has height %zu, expected %zu", *key, node->height,
+                   height);
+    }
+
+    if (l > r + 1 || r > l + 1) {
+        error_quit("key %d is out of balance, %zu vs %zu", *key, l, r);
+    }
+
+    if (node->count != bst_size(node->left) + 1 + bst_size(node->right)) {
+        error_quit("key %d has a subtree size of %zu", *key, node->count);
+    }
+
+    return height;
+}
+
+/**
+ * check_tree:
+ *      Verify the AVL invariants and that exactly the keys marked in
+ *      present are in the tree.
+ */
+void check_tree(bst_node *root, const bool *present) {
+    size_t expected = 0;
+
+    check_avl(root, NULL, NULL);
+
+    for (intptr_t key = 0; key < KEY_RANGE; key++) {
+        bst_node *node = bst_lookup(root, (void *)key, compare_int);
+        if (present[key] != (node != NULL)) {
+            error_quit("key %d is %s", (int)key,
+                       present[key] ? "missing" : "unexpected");
+        }
+        expected += present[key];
+    }
+
+    if (bst_size(root) != expected) {
+        error_quit("tree has %zu nodes, expected %zu", bst_size(root),
+                   expected);
+    }
+}
+
+/**
+ * expect_key:
+ *      Compare a bound returned by the tree against the expected key,
+ *      -1 meaning no element.
+ */
+static void expect_key(const char *what, int key, const void *got,
+                       int expected) {
+    int value = got ? *(const int *)got : -1;
+
+    if (value != expected) {
+        error_quit("%s of %d is %d, expected %d", what, key, value, expected);
+    }
+}
+
+/**
+ * check_bounds:
+ *      Verify lower_bound, upper_bound, floor and ceil for every key in
+ *      and just outside the key range.
+ */
+void check_bounds(const bst_tree *tree, const bool *present) {
+    int floor_of[KEY_RANGE + 2], ceil_of[KEY_RANGE + 2];
+    int last = -1;
+
+    // Index k + 1 holds the answer for key k, so -1 and KEY_RANGE fit
+    for (int k = -1; k <= KEY_RANGE; k++) {
+        if (k >= 0 && k < KEY_RANGE && present[k]) {
+            last = k;
+        }
+        floor_of[k + 1] = last;
+    }
+
+    last = -1;
+    for (int k = KEY_RANGE; k >= -1; k--) {
+        if (k >= 0 && k < KEY_RANGE && present[k]) {
+            last = k;
+        }
+        ceil_of[k + 1] = last;
+    }
+
+    for (int k = -1; k <= KEY_RANGE; k++) {
+        int above = k + 1 <= KEY_RANGE ? ceil_of[k + 2] : -1;
+
+        expect_key("floor", k, bst_tree_floor(tree, &k), floor_of[k + 1]);
+        expect_key("ceil", k, bst_tree_ceil(tree, &k), ceil_of[k + 1]);
+        expect_key("lower_bound", k, bst_tree_lower_bound(tree, &k),
+                   ceil_of[k + 1]);
+        expect_key("upper_bound", k, bst_tree_upper_bound(tree, &k), above);
+    }
+}
+
+/**
+ * check_order_statistics:
+ *      Verify rank and select agree with the reference for every key.
+ */
+void check_order_statistics(const bst_tree *tree, const bool *present) {
+    size_t rank = 0;
+
+    for (int k = 0; k < KEY_RANGE; k++) {
+        if (bst_tree_rank(tree, &k) != rank) {
+            error_quit("rank of %d is %zu, expected %zu", k,
+                       bst_tree_rank(tree, &k), rank);
+        }
+
+        if (present[k]) {
+            const int *got = bst_tree_select(tree, rank);
+            if (!got || *got != k) {
+                error_quit("select of %zu did not return %d", rank, k);
+            }
+            rank++;
+        }
+    }
+
+    if (bst_tree_select(tree, rank)) {
+        error_quit("select past the end returned an element");
+    }
+}
+
+/**
+ * collect:
+ *      Range visitor storing keys, stopping once limit keys are seen.
+ */
+visit_result collect(void *data, void *arg) {
+    range_collector *c = arg;
+
+    c->keys[c->count++] = *(int *)data;
+
+    return c->count == c->limit ? VISIT_STOP : VISIT_CONTINUE;
+}
+
+/**
+ * check_ranges:
+ *      Verify range scans, early termination and range counts over
+ *      random bounds.
+ */
+void check_ranges(const bst_tree *tree, const bool *present, uint64_t seed) {
+    range_collector *c = malloc(sizeof(range_collector));
+    if (!c) {
+        error_syscall("Unable to allocate range collector");
+    }
+
+    for (int i = 0; i < 500; i++) {
+        int lo = (int)(next_random(&seed) % (KEY_RANGE + 2)) - 1;
+        int hi = (int)(next_random(&seed) % (KEY_RANGE + 2)) - 1;
+        size_t expected = 0;
+
+        for (int k = lo < 0 ? 0 : lo; k <= hi && k < KEY_RANGE; k++) {
+            expected += present[k];
+        }
+
+        if (bst_range_count(tree, &lo, &hi) != expected) {
+            error_quit("range count of [%d, %d] is %zu, expected %zu", lo, hi,
+                       bst_range_count(tree, &lo, &hi), expected);
+        }
+
+        c->count = 0;
+        c->limit = (i % 4 == 0) ? 1 + expected / 2 : KEY_RANGE + 1;
+        size_t visited = bst_range(tree, &lo, &hi, collect, c);
+        size_t want = expected < c->limit ? expected : c->limit;
+
+        if (visited != want || c->count != want) {
+            error_quit("range [%d, %d] visited %zu, expected %zu", lo, hi,
+                       visited, want);
+        }
+
+        for (size_t j = 0, k = lo < 0 ? 0 : lo; j < c->count; j++, k++) {
+            while (!present[k]) {
+                k++;
+            }
+            if (c->keys[j] != (int)k) {
+                error_quit("range [%d, %d] visited %d, expected %zu", lo, hi,
+                           c->keys[j], k);
+            }
+        }
+    }
+
+    c->count = 0;
+    c->limit = KEY_RANGE + 1;
+    if (bst_range(tree, NULL, NULL, collect, c) != bst_tree_size(tree) ||
+        bst_range_count(tree, NULL, NULL) != bst_tree_size(tree)) {
+        error_quit("open range did not cover the whole tree");
+    }
+
+    free(c);
+}
+
+/**
+ * check_iterators:
+ *      Walk the tree forward and backward with cursors and verify seeks
+ *      followed by steps in both directions.
+ */
+void check_iterators(const bst_tree *tree, const bool *present,
+                     uint64_t seed) {
+    bst_iter it;
+    const int *got;
+    int k;
+
+    bst_iter_init(&it, tree);
+    k = -1;
+    while ((got = bst_iter_next(&it))) {
+        do {
+            k++;
+        } while (k < KEY_RANGE && !present[k]);
+        if (k == KEY_RANGE || *got != k) {
+            error_quit("forward iteration returned %d, expected %d", *got, k);
+        }
+    }
+
+    bst_iter_init(&it, tree);
+    k = KEY_RANGE;
+    while ((got = bst_iter_prev(&it))) {
+        do {
+            k--;
+        } while (k >= 0 && !present[k]);
+        if (k < 0 || *got != k) {
+            error_quit("reverse iteration returned %d, expected %d", *got, k);
+        }
+    }
+
+    for (int i = 0; i < 500; i++) {
+        int key = (int)(next_random(&seed) % KEY_RANGE);
+        int next = key, prev = key;
+
+        while (next < KEY_RANGE && !present[next]) {
+            next++;
+        }
+
+        got = bst_iter_seek(&it, &key);
+        if ((got ? *got : KEY_RANGE) != next) {
+            error_quit("seek to %d found %d, expected %d", key,
+                       got ? *got : -1, next);
+        }
+
+        if (!got) {
+            continue;
+        }
+
+        // Step back past the sought element and forward again
+        do {
+            prev--;
+        } while (prev >= 0 && !present[prev]);
+        got = bst_iter_prev(&it);
+        if ((got ? *got : -1) != prev) {
+            error_quit("step back from %d found %d, expected %d", next,
+                       got ? *got : -1, prev);
+        }
+
+        got = prev >= 0 ? bst_iter_next(&it) : bst_iter_seek(&it, &key);
+        if (!got || *got != next || *(int *)bst_iter_current(&it) != next) {
+            error_quit("step forward did not return to %d", next);
+        }
+    }
+}
+
+/**
+ * check_batches:
+ *      Look up every key in one batch, then batch insert the missing
+ *      even keys and verify the tree and reference agree.
+ */
+void check_batches(bst_tree *tree, bool *present) {
+    int keys[KEY_RANGE];
+    void *results[KEY_RANGE];
+    size_t missing = 0;
+
+    for (int k = 0; k < KEY_RANGE; k++) {
+        keys[k] = k;
+    }
+
+    bst_lookup_batch(tree, keys, KEY_RANGE, results);
+    for (int k = 0; k < KEY_RANGE; k++) {
+        if ((results[k] != NULL) != present[k] ||
+            (results[k] && *(int *)results[k] != k)) {
+            error_quit("batched lookup of %d is wrong", k);
+        }
+    }
+
+    for (int k = 0; k < KEY_RANGE; k += 2) {
+        keys[k / 2] = k;
+        missing += !present[k];
+        present[k] = true;
+    }
+
+    if (bst_insert_batch(tree, keys, KEY_RANGE / 2) != missing) {
+        error_quit("batched insert did not add %zu elements", missing);
+    }
+    check_tree(bst_tree_root(tree), present);
+}
+
+/**
+ * check_frozen:
+ *      Freeze the tree and verify the snapshot answers lookups, bounds
+ *      and ranges the same way the tree does.
+ */
+void check_frozen(const bst_tree *tree, uint64_t seed) {
+    bst_frozen *f = bst_freeze(tree);
+
+    check_snapshot(tree, f, seed);
+    bst_frozen_delete(f);
+}
+
+/**
+ * check_snapshot:
+ *      Verify lookups, bounds and ranges of a snapshot against its tree.
+ */
+void check_snapshot(const bst_tree *tree, const bst_frozen *f,
+                    uint64_t seed) {
+    range_collector *c = malloc(sizeof(range_collector));
+    if (!c) {
+        error_syscall("Unable to allocate range collector");
+    }
+
+    if (bst_frozen_size(f) != bst_tree_size(tree)) {
+        error_quit("snapshot has %zu elements, expected %zu",
+                   bst_frozen_size(f), bst_tree_size(tree));
+    }
+
+    for (int k = -1; k <= KEY_RANGE; k++) {
+        const int *want = bst_tree_lookup(tree, &k);
+
+        expect_key("frozen lookup", k, bst_frozen_lookup(f, &k),
+                   want ? *want : -1);
+        want = bst_tree_floor(tree, &k);
+        expect_key("frozen floor", k, bst_frozen_floor(f, &k),
+                   want ? *want : -1);
+        want = bst_tree_ceil(tree, &k);
+        expect_key("frozen ceil", k, bst_frozen_ceil(f, &k),
+                   want ? *want : -1);
+    }
+
+    for (int i = 0; i < 200; i++) {
+        int lo = (int)(next_random(&seed) % (KEY_RANGE + 2)) - 1;
+        int hi = (int)(next_random(&seed) % (KEY_RANGE + 2)) - 1;
+
+        c->count = 0;
+        c->limit = KEY_RANGE + 1;
+        size_t visited = bst_frozen_range(f, &lo, &hi, collect, c);
+        if (visited != bst_range_count(tree, &lo, &hi)) {
+            error_quit("frozen range [%d, %d] visited %zu", lo, hi, visited);
+        }
+        for (size_t j = 0; j < c->count; j++) {
+            if (c->keys[j] < lo || c->keys[j] > hi ||
+                (j && c->keys[j - 1] >= c->keys[j])) {
+                error_quit("frozen range [%d, %d] is out of order", lo, hi);
+            }
+        }
+    }
+
+    c->count = 0;
+    if (bst_frozen_range(f, NULL, NULL, collect, c) != bst_tree_size(tree)) {
+        error_quit("open frozen range did not cover the snapshot");
+    }
+
+    free(c);
+}
+
+// Search kernels of bst_frozen_int, not all are supported everywhere
+static const char *const int_kernels[] = {"scalar", "sse2", "avx2"};
+
+/**
+ * check_frozen_int:
+ *      Freeze the tree as ints and verify every available search kernel
+ *      answers ceil and membership the same way the tree does.
+ */
+void check_frozen_int(const bst_tree *tree) {
+    bst_frozen_int *f = bst_freeze_int(tree);
+    if (!f || bst_frozen_int_size(f) != bst_tree_size(tree)) {
+        error_quit("int snapshot of %zu elements failed", bst_tree_size(tree));
+    }
+
+    for (size_t i = 0; i < sizeof(int_kernels) / sizeof(*int_kernels); i++) {
+        if (!bst_frozen_int_use_kernel(f, int_kernels[i])) {
+            continue;
+        }
+
+        for (int k = -1; k <= KEY_RANGE; k++) {
+            const int *want = bst_tree_ceil(tree, &k);
+            int got = -1;
+
+            bst_frozen_int_ceil(f, k, &got);
+            expect_key(int_kernels[i], k, &got, want ? *want : -1);
+            if (bst_frozen_int_contains(f, k) !=
+                (bst_tree_lookup(tree, &k) != NULL)) {
+                error_quit("%s membership of %d is wrong", int_kernels[i], k);
+            }
+        }
+    }
+
+    bst_frozen_int_delete(f);
+}
+
+/**
+ * frozen_int_extremes_test:
+ *      Int snapshots holding INT_MIN and INT_MAX, which collide with the
+ *      padding, and rejection of trees that are not ints.
+ */
+void frozen_int_extremes_test(void) {
+    int keys[] = {INT_MIN, -7, 0, 42, INT_MAX - 1, INT_MAX};
+    size_t n = sizeof(keys) / sizeof(*keys);
+
+    printf("Checking int snapshots at the limits of int\n");
+    for (size_t with_max = 0; with_max < 2; with_max++) {
+        bst_tree *tree = bst_tree_new(sizeof(int), compare_int, NULL);
+        bst_tree_build_from_sorted(tree, keys, n - 1 + with_max);
+
+        bst_frozen_int *f = bst_freeze_int(tree);
+        for (size_t i = 0; i < sizeof(int_kernels) / sizeof(*int_kernels);
+             i++) {
+            if (!bst_frozen_int_use_kernel(f, int_kernels[i])) {
+                continue;
+            }
+
+            int got;
+            if (!bst_frozen_int_contains(f, INT_MIN) ||
+                bst_frozen_int_contains(f, INT_MAX) != (bool)with_max ||
+                !bst_frozen_int_ceil(f, INT_MIN + 1, &got) || got != -7 ||
+                bst_frozen_int_ceil(f, INT_MAX, &got) != (bool)with_max) {
+                error_quit("%s kernel is wrong at the limits of int",
+                           int_kernels[i]);
+            }
+        }
+
+        bst_frozen_int_delete(f);
+        bst_tree_delete(tree, NULL);
+    }
+
+    bst_tree *wide = bst_tree_new(sizeof(long), compare_int, NULL);
+    if (bst_freeze_int(wide)) {
+        error_quit("froze a tree of longs as ints");
+    }
+    bst_tree_delete(wide, NULL);
+}
+
+/**
+ * tree_stress_test:
+ *      Random inserts and removes through a bst_tree handle.
+ */
+void tree_stress_test(uint64_t seed) {
+    bool present[KEY_RANGE] = {false};
+    bst_tree *tree = bst_tree_new(sizeof(int), compare_int, NULL);
+    size_t count = 0;
+
+    printf("Running %d random tree operations\n", OPERATIONS);
+    for (size_t i = 0; i < OPERATIONS; i++) {
+        uint64_t r = next_random(&seed);
+        int key = (int)((r >> 8) % KEY_RANGE);
+
+        // Bias toward inserts while the tree is small, removes after
+        bool insert = (r & 0xff) >= (count * 256) / KEY_RANGE;
+        if (insert) {
+            if (bst_tree_insert(tree, &key) == present[key]) {
+                error_quit("insert of %d reported the wrong result", key);
+            }
+            count += !present[key];
+            present[key] = true;
+        } else {
+            if (bst_tree_remove(tree, &key) != present[key]) {
+                error_quit("remove of %d reported the wrong result", key);
+            }
+            count -= present[key];
+            present[key] = false;
+        }
+
+        if (bst_tree_size(tree) != count) {
+            error_quit("tree reports %zu elements, expected %zu",
+                       bst_tree_size(tree), count);
+        }
+
+        check_tree(bst_tree_root(tree), present);
+    }
+
+    check_bounds(tree, present);
+    check_order_statistics(tree, present);
+    check_ranges(tree, present, seed);
+    check_iterators(tree, present, seed);
+    check_frozen(tree, seed);
+    check_frozen_int(tree);
+    printf("Tree height with %zu elements is %zu\n", count,
+           bst_tree_height(tree));
+    check_batches(tree, present);
+
+    bst_tree_delete(tree, NULL);
+}
+
+/**
+ * node_stress_test:
+ *      Random inserts and removes through the per node functions,
+ *      checking the invariants after every operation.
+ */
+void node_stress_test(uint64_t seed) {
+    bool present[KEY_RANGE / 4] = {false};
+    bst_node *root = NULL;
+
+    printf("Running %d random node operations\n", OPERATIONS / 4);
+    for (size_t i = 0; i < OPERATIONS / 4; i++) {
+        uint64_t r = next_random(&seed);
+        intptr_t key = (intptr_t)((r >> 8) % (KEY_RANGE / 4));
+
+        if (r & 1) {
+            root = bst_insert(root, sizeof(int), (void *)key, compare_int);
+            present[key] = true;
+        } else {
+            root = bst_remove_node(root, (void *)key, compare_int, NULL);
+            present[key] = false;
+        }
+
+        check_avl(root, NULL, NULL);
+        if (bst_lookup(root, (void *)key, compare_int) ? !present[key]
+                                                        : present[key]) {
+            error_quit("key %d is in the wrong state", (int)key);
+        }
+    }
+
+    bst_delete_tree(root, NULL, NULL);
+}
+
+/**
+ * build_test:
+ *      Bulk load sorted and unsorted input of every size up to the key
+ *      range and check the result is a valid AVL tree.
+ */
+void build_test(uint64_t seed) {
+    int sorted[KEY_RANGE], shuffled[2 * KEY_RANGE];
+    bool present[KEY_RANGE];
+
+    printf("Bulk loading trees of up to %d elements\n", KEY_RANGE);
+    for (size_t n = 0; n <= KEY_RANGE; n += 1 + n / 8) {
+        size_t m = 0;
+
+        for (int k = 0; k < KEY_RANGE; k++) {
+            present[k] = next_random(&seed) % KEY_RANGE < n;
+            if (present[k]) {
+                sorted[m++] = k;
+            }
+        }
+
+        bst_node *root = bst_build_from_sorted(sorted, m, sizeof(int));
+        check_tree(root, present);
+        bst_delete_tree(root, NULL, NULL);
+
+        // Every element twice in random order
+        for (size_t i = 0; i < 2 * m; i++) {
+            shuffled[i] = sorted[i % m];
+        }
+        for (size_t i = 2 * m; i > 1; i--) {
+            size_t j = next_random(&seed) % i;
+            int tmp = shuffled[i - 1];
+            shuffled[i - 1] = shuffled[j];
+            shuffled[j] = tmp;
+        }
+
+        bst_tree *tree = bst_tree_new(sizeof(int), compare_int, NULL);
+        if (!bst_tree_build_from_array(tree, shuffled, 2 * m) ||
+            bst_tree_size(tree) != m) {
+            error_quit("building from %zu shuffled elements failed", 2 * m);
+        }
+        check_tree(bst_tree_root(tree), present);
+        check_frozen(tree, seed);
+        check_frozen_int(tree);
+        bst_tree_delete(tree, NULL);
+    }
+}
+
+// Inorder walk state for check_compact_order
+static int compact_last;
+static size_t compact_seen;
+
+/**
+ * check_compact_order:
+ *      Traversal callback verifying keys arrive in increasing order.
+ */
+void check_compact_order(void *data) {
+    int key = *(int *)data;
+
+    if (key <= compact_last) {
+        error_quit("compact traversal visited %d after %d", key, compact_last);
+    }
+    compact_last = key;
+    compact_seen++;
+}
+
+/**
+ * compact_stress_test:
+ *      Random inserts and removes on a compact tree, checking membership,
+ *      order and the AVL height bound as it goes.
+ */
+void compact_stress_test(uint64_t seed) {
+    bool present[KEY_RANGE] = {false};
+    bst_compact *c = bst_compact_new(sizeof(int), compare_int, NULL);
+    size_t count = 0;
+
+    printf("Running %d random compact tree operations\n", OPERATIONS);
+    for (size_t i = 0; i < OPERATIONS; i++) {
+        uint64_t r = next_random(&seed);
+        int key = (int)((r >> 8) % KEY_RANGE);
+
+        if ((r & 0xff) >= (count * 256) / KEY_RANGE) {
+            if (bst_compact_insert(c, &key) == present[key]) {
+                error_quit("compact insert of %d reported the wrong result",
+                           key);
+            }
+            count += !present[key];
+            present[key] = true;
+        } else {
+            if (bst_compact_remove(c, &key) != present[key]) {
+                error_quit("compact remove of %d reported the wrong result",
+                           key);
+            }
+            count -= present[key];
+            present[key] = false;
+        }
+
+        const int *got = bst_compact_lookup(c, &key);
+        if ((got != NULL) != present[key] || (got && *got != key)) {
+            error_quit("compact lookup of %d is wrong", key);
+        }
+
+        // Smallest AVL tree of height h + 1 has more than count nodes
+        size_t a = 0, b = 1, h = 1;
+        while (a + b + 1 <= count) {
+            size_t next = a + b + 1;
+            a = b;
+            b = next;
+            h++;
+        }
+        if (bst_compact_size(c) != count ||
+            bst_compact_height(c) > (count ? h : 0)) {
+            error_quit("compact tree of %zu elements has height %zu",
+                       bst_compact_size(c), bst_compact_height(c));
+        }
+
+        if (i % 64 == 0) {
+            compact_last = -1;
+            compact_seen = 0;
+            bst_compact_traverse_inorder(c, check_compact_order);
+            if (compact_seen != count) {
+                error_quit("compact traversal visited %zu of %zu elements",
+                           compact_seen, count);
+            }
+        }
+    }
+
+    for (int k = 0; k < KEY_RANGE; k++) {
+        if ((bst_compact_lookup(c, &k) != NULL) != present[k]) {
+            error_quit("compact key %d is %s", k,
+                       present[k] ? "missing" : "unexpected");
+        }
+    }
+
+    printf("Compact tree holds %zu elements in %zu bytes\n", count,
+           bst_compact_memory(c));
+    bst_compact_delete(c, NULL);
+}
+
+/**
+ * random_keys:
+ *      Pick each key below range with probability percent / 100, mark it
+ *      in present, store the picks in keys and return how many there are.
+ */
+static size_t random_keys(uint64_t *seed, int range, unsigned percent,
+                          bool *present, int *keys) {
+    size_t n = 0;
+
+    for (int k = 0; k < range; k++) {
+        present[k] = next_random(seed) % 100 < percent;
+        if (present[k]) {
+            keys[n++] = k;
+        }
+    }
+
+    return n;
+}
+
+/**
+ * split_join_test:
+ *      Split random trees at every kind of key and join the halves back.
+ */
+void split_join_test(uint64_t seed) {
+    bool present[KEY_RANGE];
+    int keys[KEY_RANGE];
+
+    printf("Splitting and joining trees\n");
+    for (int i = 0; i < 200; i++) {
+        size_t n = random_keys(&seed, KEY_RANGE, i % 100, present, keys);
+        bst_node *root = bst_build_from_sorted(keys, n, sizeof(int));
+        bst_node *lo, *hi;
+        int key = (int)(next_random(&seed) % (KEY_RANGE + 2)) - 1;
+
+        bst_node *mid = bst_split(root, &key, compare_int, &lo, &hi);
+        check_avl(lo, NULL, &key);
+        check_avl(hi, &key, NULL);
+        if ((mid != NULL) != (key >= 0 && key < KEY_RANGE && present[key]) ||
+            bst_size(lo) + bst_size(hi) + (mid != NULL) != n) {
+            error_quit("split at %d lost elements", key);
+        }
+
+        // Without a match rejoin around the smallest element above key
+        if (!mid && hi) {
+            int first = *(int *)bst_min_value_node(hi)->data;
+            bst_node *below;
+            mid = bst_split(hi, &first, compare_int, &below, &hi);
+        }
+
+        root = mid ? bst_join(lo, mid, hi) : lo;
+        check_tree(root, present);
+        bst_delete_tree(root, NULL, NULL);
+    }
+}
+
+/**
+ * set_ops_test:
+ *      Union, intersection and difference of random trees against the
+ *      reference, small ones exhaustively and large ones that are split
+ *      across the thread pool.
+ */
+void set_ops_test(uint64_t seed) {
+    static bool a[KEY_RANGE * KEY_RANGE / 4], b[sizeof(a)];
+    static int keys[sizeof(a)];
+    int sizes[] = {KEY_RANGE, (int)sizeof(a)};
+
+    printf("Running set operations\n");
+    for (int round = 0; round < 60; round++) {
+        int range = sizes[round % 20 == 19];
+        unsigned pa = next_random(&seed) % 100, pb = next_random(&seed) % 100;
+        int op = round % 3;
+        bst_tree *dst = bst_tree_new(sizeof(int), compare_int, NULL);
+        bst_tree *src = bst_tree_new(sizeof(int), compare_int, NULL);
+        size_t expected = 0;
+
+        bst_tree_build_from_sorted(dst, keys,
+                                   random_keys(&seed, range, pa, a, keys));
+        bst_tree_build_from_sorted(src, keys,
+                                   random_keys(&seed, range, pb, b, keys));
+
+        bool ok = op == 0   ? bst_union(dst, src)
+                  : op == 1 ? bst_intersect(dst, src)
+                            : bst_difference(dst, src);
+        if (!ok || bst_tree_size(src) != 0 || bst_tree_root(src)) {
+            error_quit("set operation %d did not consume its source", op);
+        }
+
+        check_avl(bst_tree_root(dst), NULL, NULL);
+        for (int k = 0; k < range; k++) {
+            bool want = op == 0 ? a[k] || b[k]
+                        : op == 1 ? a[k] && b[k]
+                                  : a[k] && !b[k];
+            if ((bst_tree_lookup(dst, &k) != NULL) != want) {
+                error_quit("set operation %d is wrong at %d", op, k);
+            }
+            expected += want;
+        }
+        if (bst_tree_size(dst) != expected) {
+            error_quit("set operation %d left %zu elements, expected %zu", op,
+                       bst_tree_size(dst), expected);
+        }
+
+        bst_tree_delete(dst, NULL);
+        bst_tree_delete(src, NULL);
+    }
+
+    bst_tree *tree = bst_tree_new(sizeof(int), compare_int, NULL);
+    bst_tree *other = bst_tree_new(sizeof(long), compare_int, NULL);
+    if (bst_union(tree, tree) || bst_union(tree, other)) {
+        error_quit("set operation accepted incompatible trees");
+    }
+    bst_tree_delete(tree, NULL);
+    bst_tree_delete(other, NULL);
+}
+
+/**
+ * add_elem:
+ *      Parallel apply callback summing elements into a shared total.
+ */
+static void add_elem(void *data, void *arg) {
+    __atomic_fetch_add((long long *)arg, *(int *)data, __ATOMIC_RELAXED);
+}
+
+/**
+ * fold_summary:
+ *      Fold an element into an order summary.
+ */
+static void fold_summary(void *acc, const void *data, void *arg) {
+    order_summary *s = acc;
+    int key = *(const int *)data;
+
+    (void)arg;
+    if (s->count) {
+        s->sorted = s->sorted && s->last < key;
+    } else {
+        s->first = key;
+    }
+    s->last = key;
+    s->sum += key;
+    s->count++;
+}
+
+/**
+ * combine_summary:
+ *      Append the summary of the elements after acc to it.
+ */
+static void combine_summary(void *acc, const void *next, void *arg) {
+    order_summary *s = acc;
+    const order_summary *n = next;
+
+    (void)arg;
+    if (!n->count) {
+        return;
+    }
+    if (!s->count) {
+        *s = *n;
+        return;
+    }
+
+    s->sorted = s->sorted && n->sorted && s->last < n->first;
+    s->last = n->last;
+    s->sum += n->sum;
+    s->count += n->count;
+}
+
+// Growing array of keys, an accumulator owning memory
+typedef struct key_list {
+    int *keys;
+    size_t count, cap;
+} key_list;
+
+/**
+ * append_keys:
+ *      Append n keys to a key list.
+ */
+static void append_keys(key_list *l, const int *keys, size_t n) {
+    if (!n) {
+        return;
+    }
+    if (l->count + n > l->cap) {
+        l->cap = 2 * (l->count + n);
+        l->keys = realloc(l->keys, l->cap * sizeof(int));
+        if (!l->keys) {
+            error_syscall("Unable to grow key list");
+        }
+    }
+    memcpy(l->keys + l->count, keys, n * sizeof(int));
+    l->count += n;
+}
+
+/**
+ * fold_list, combine_list, free_list:
+ *      Reduce callbacks concatenating elements into a key list.
+ */
+static void fold_list(void *acc, const void *data, void *arg) {
+    (void)arg;
+    append_keys(acc, data, 1);
+}
+
+static void combine_list(void *acc, const void *next, void *arg) {
+    const key_list *n = next;
+
+    (void)arg;
+    append_keys(acc, n->keys, n->count);
+}
+
+static void free_list(void *acc, void *arg) {
+    (void)arg;
+    free(((key_list *)acc)->keys);
+}
+
+/**
+ * parallel_test:
+ *      Parallel for each and ordered reduce over trees large enough to be
+ *      split across the thread pool.
+ */
+void parallel_test(void) {
+    static int keys[KEY_RANGE * 256];
+    size_t sizes[] = {0, 1, KEY_RANGE, sizeof(keys) / sizeof(*keys)};
+
+    for (size_t i = 0; i < sizeof(keys) / sizeof(*keys); i++) {
+        keys[i] = (int)i;
+    }
+
+    printf("Running parallel traversals\n");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+        size_t n = sizes[i];
+        long long want = (long long)n * ((long long)n - 1) / 2, total = 0;
+        bst_tree *tree = bst_tree_new(sizeof(int), compare_int, NULL);
+        bst_tree_build_from_sorted(tree, keys, n);
+
+        bst_parallel_for_each(tree, add_elem, &total);
+        if (total != want) {
+            error_quit("parallel for each summed %lld, expected %lld", total,
+                       want);
+        }
+
+        order_summary s = {0, 0, 0, 0, true};
+        bst_reduce(tree, &s, sizeof(s), fold_summary, combine_summary, NULL,
+                   NULL);
+        if (!s.sorted || s.count != n || s.sum != want ||
+            (n && (s.first != 0 || s.last != (int)n - 1))) {
+            error_quit("ordered reduce of %zu elements is wrong", n);
+        }
+
+        // Concatenate into buffers owned by the accumulators
+        key_list list = {NULL, 0, 0};
+        bst_reduce(tree, &list, sizeof(list), fold_list, combine_list,
+                   free_list, NULL);
+        for (size_t k = 0; k < list.count; k++) {
+            if (list.keys[k] != (int)k) {
+                error_quit("concatenated %d at %zu", list.keys[k], k);
+            }
+        }
+        if (list.count != n) {
+            error_quit("concatenated %zu of %zu elements", list.count, n);
+        }
+        free_list(&list, NULL);
+
+        bst_tree_delete(tree, NULL);
+    }
+}
+
+// Level order walk state for check_level
+typedef struct level_check {
+    bst_node *root;
+    size_t last_depth;
+    size_t seen;
+    size_t limit;
+} level_check;
+
+/**
+ * check_level:
+ *      Level order visitor verifying depths never decrease, stopping once
+ *      limit elements are seen.
+ */
+static visit_result check_level(void *data, void *arg) {
+    level_check *c = arg;
+    int key = *(int *)data;
+    size_t depth = 0;
+
+    for (bst_node *n = c->root; *(int *)n->data != key; depth++) {
+        n = key < *(int *)n->data ? n->left : n->right;
+    }
+    if (depth < c->last_depth) {
+        error_quit("level order visited %d at depth %zu after depth %zu", key,
+                   depth, c->last_depth);
+    }
+    c->last_depth = depth;
+
+    return ++c->seen == c->limit ? VISIT_STOP : VISIT_CONTINUE;
+}
+
+/**
+ * level_order_test:
+ *      Level order traversals of random trees, complete and cut short.
+ */
+void level_order_test(uint64_t seed) {
+    bool present[KEY_RANGE];
+    int keys[KEY_RANGE];
+
+    printf("Running level order traversals\n");
+    for (int i = 0; i < 100; i++) {
+        size_t n = random_keys(&seed, KEY_RANGE, i, present, keys);
+        bst_node *root = bst_build_from_array(keys, n, sizeof(int),
+                                              compare_int);
+        level_check c = {root, 0, 0, i % 2 ? n / 2 + 1 : n + 1};
+        size_t want = n < c.limit ? n : c.limit;
+
+        if (bst_traverse_level_order(root, check_level, &c) != want ||
+            c.seen != want) {
+            error_quit("level order visited %zu of %zu", c.seen, want);
+        }
+        bst_delete_tree(root, NULL, NULL);
+    }
+}
+
+// Last element displayed by check_delete_order
+static int deleted_last;
+
+/**
+ * check_delete_order:
+ *      Display callback verifying deletion goes in order.
+ */
+static void check_delete_order(void *data) {
+    if (*(int *)data != deleted_last + 1) {
+        error_quit("deleted %d after %d", *(int *)data, deleted_last);
+    }
+    deleted_last = *(int *)data;
+}
+
+/**
+ * degenerate_delete_test:
+ *      Delete chains far deeper than any balanced tree, which the old
+ *      recursive delete could not survive.
+ */
+void degenerate_delete_test(void) {
+    int n = 1 << 20;
+
+    printf("Deleting degenerate trees of %d nodes\n", n);
+    for (int side = 0; side < 2; side++) {
+        bst_node *root = NULL;
+
+        // side 0 chains right children, side 1 left children
+        for (int k = 0; k < n; k++) {
+            intptr_t key = side ? k : n - 1 - k;
+            bst_node *node = bst_new_node(sizeof(int), (void *)key);
+            if (side) {
+                node->left = root;
+            } else {
+                node->right = root;
+            }
+            root = node;
+        }
+
+        deleted_last = -1;
+        bst_delete_tree(root, NULL, check_delete_order);
+        if (deleted_last != n - 1) {
+            error_quit("delete stopped at %d", deleted_last);
+        }
+    }
+}
+
+/**
+ * save_load_test:
+ *      Save random trees, load them back and search the mapped files.
+ */
+void save_load_test(uint64_t seed) {
+    bool present[KEY_RANGE];
+    int keys[KEY_RANGE];
+    char path[] = "/tmp/test_bst_XXXXXX";
+
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        error_syscall("Unable to create %s", path);
+    }
+    close(fd);
+
+    printf("Saving and loading trees\n");
+    for (int i = 0; i < 100; i += 3) {
+        size_t n = random_keys(&seed, KEY_RANGE, i, present, keys);
+        bst_tree *tree = bst_tree_new(sizeof(int), compare_int, NULL);
+        bst_tree_build_from_array(tree, keys, n);
+
+        if (!bst_save(tree, path)) {
+            error_quit("unable to save a tree of %zu elements", n);
+        }
+
+        bst_tree *loaded = bst_load(path, compare_int, NULL);
+        if (!loaded || bst_tree_size(loaded) != n) {
+            error_quit("loaded tree does not have %zu elements", n);
+        }
+        check_tree(bst_tree_root(loaded), present);
+        bst_tree_delete(loaded, NULL);
+
+        bst_frozen *f = bst_mmap_open(path, compare_int);
+        if (!f) {
+            error_quit("unable to map a tree of %zu elements", n);
+        }
+        check_snapshot(tree, f, seed);
+        bst_frozen_delete(f);
+        bst_tree_delete(tree, NULL);
+    }
+
+    // A truncated file, a foreign file and a missing one are all refused
+    if (truncate(path, 40) || bst_mmap_open(path, compare_int)) {
+        error_quit("opened a truncated tree file");
+    }
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        error_syscall("Unable to rewrite %s", path);
+    }
+    fprintf(file, "%0128d", 0);
+    fclose(file);
+    if (bst_load(path, compare_int, NULL)) {
+        error_quit("loaded a file that is not a tree");
+    }
+    unlink(path);
+    if (bst_mmap_open(path, compare_int)) {
+        error_quit("opened a missing tree file");
+    }
+}
+
+// In memory stream, reads hand out at most chunk bytes at a time
+typedef struct byte_pipe {
+    unsigned char *bytes;
+    size_t len, cap, pos, chunk;
+    size_t writes_left; // writes that succeed before failing
+    size_t failures;    // writes refused
+} byte_pipe;
+
+/**
+ * pipe_write:
+ *      Write callback appending to a byte_pipe.
+ */
+static bool pipe_write(const void *data, size_t len, void *arg) {
+    byte_pipe *p = arg;
+
+    if (!p->writes_left) {
+        p->failures++;
+        return false;
+    }
+    p->writes_left--;
+    if (p->len + len > p->cap) {
+        p->cap = 2 * (p->len + len);
+        p->bytes = realloc(p->bytes, p->cap);
+        if (!p->bytes) {
+            error_syscall("Unable to grow byte pipe");
+        }
+    }
+    memcpy(p->bytes + p->len, data, len);
+    p->len += len;
+
+    return true;
+}
+
+/**
+ * pipe_read:
+ *      Read callback taking from a byte_pipe in short chunks.
+ */
+static size_t pipe_read(void *buf, size_t len, void *arg) {
+    byte_pipe *p = arg;
+    size_t n = p->len - p->pos;
+
+    n = n < len ? n : len;
+    n = n < p->chunk ? n : p->chunk;
+    memcpy(buf, p->bytes + p->pos, n);
+    p->pos += n;
+
+    return n;
+}
+
+/**
+ * import_fails:
+ *      True if importing the pipe into a new tree is refused and leaves
+ *      the tree empty.
+ */
+static bool import_fails(byte_pipe *p) {
+    bst_tree *tree = bst_tree_new(sizeof(int), compare_int, NULL);
+
+    p->pos = 0;
+    bool failed = !bst_tree_import(tree, pipe_read, p) &&
+                  !bst_tree_size(tree) && !bst_tree_root(tree);
+    bst_tree_delete(tree, NULL);
+
+    return failed;
+}
+
+/**
+ * stream_test:
+ *      Export random trees through a pipe and import them back, then
+ *      check broken streams are refused.
+ */
+void stream_test(uint64_t seed) {
+    bool present[KEY_RANGE];
+    int keys[KEY_RANGE];
+    int tail = -1;
+
+    printf("Streaming trees\n");
+    for (int i = 0; i < 100; i += 3) {
+        size_t n = random_keys(&seed, KEY_RANGE, i, present, keys);
+        bst_tree *tree = bst_tree_new(sizeof(int), compare_int, NULL);
+        byte_pipe p = {NULL, 0, 0, 0, 1 + i % 13, SIZE_MAX, 0};
+
+        bst_tree_build_from_array(tree, keys, n);
+        if (!bst_tree_export(tree, pipe_write, &p) ||
+            !pipe_write(&tail, sizeof(tail), &p)) {
+            error_quit("unable to export a tree of %zu elements", n);
+        }
+
+        // The element after the tree must be left in the pipe
+        bst_tree *copy = bst_tree_new(sizeof(int), compare_int, NULL);
+        if (!bst_tree_import(copy, pipe_read, &p) ||
+            p.pos != p.len - sizeof(tail)) {
+            error_quit("unable to import a tree of %zu elements", n);
+        }
+        check_tree(bst_tree_root(copy), present);
+
+        bst_tree_delete(copy, NULL);
+        bst_tree_delete(tree, NULL);
+        free(p.bytes);
+    }
+
+    // Large enough to span many buffers
+    int n = 100000;
+    int *values = malloc(n * sizeof(int));
+    if (!values) {
+        error_syscall("Unable to allocate stream values");
+    }
+    for (int k = 0; k < n; k++) {
+        values[k] = k;
+    }
+
+    bst_tree *tree = bst_tree_new(sizeof(int), compare_int, NULL);
+    bst_tree *copy = bst_tree_new(sizeof(int), compare_int, NULL);
+    byte_pipe p = {NULL, 0, 0, 0, SIZE_MAX, SIZE_MAX, 0};
+
+    bst_tree_build_from_sorted(tree, values, n);
+    if (!bst_tree_export(tree, pipe_write, &p) ||
+        !bst_tree_import(copy, pipe_read, &p) ||
+        bst_tree_height(copy) != bst_tree_height(tree)) {
+        error_quit("unable to stream %d elements", n);
+    }
+
+    bst_iter it;
+    const int *got;
+    int want = 0;
+    bst_iter_init(&it, copy);
+    while ((got = bst_iter_next(&it))) {
+        if (*got != want++) {
+            error_quit("streamed %d in place of %d", *got, want - 1);
+        }
+    }
+    if (want != n) {
+        error_quit("streamed %d of %d elements", want, n);
+    }
+    p.pos = 0;
+    if (bst_tree_import(copy, pipe_read, &p)) {
+        error_quit("imported into a tree that is not empty");
+    }
+    bst_tree_delete(copy, NULL);
+
+    // Truncated, reordered and foreign streams
+    p.len--;
+    if (!import_fails(&p)) {
+        error_quit("imported a truncated stream");
+    }
+    p.len++;
+    size_t at = p.len - 2 * sizeof(int);
+    memcpy(p.bytes + at, &n, sizeof(int));
+    if (!import_fails(&p)) {
+        error_quit("imported a stream out of order");
+    }
+    p.bytes[0] ^= 1;
+    if (!import_fails(&p)) {
+        error_quit("imported a stream without a header");
+    }
+
+    // A failing writer stops the export
+    p.len = 0;
+    p.writes_left = 1;
+    if (bst_tree_export(tree, pipe_write, &p) || p.failures != 1) {
+        error_quit("export went on after a failed write");
+    }
+
+    bst_tree_delete(tree, NULL);
+    free(values);
+    free(p.bytes);
+}
+
+// Per tree state for the context carrying callbacks
+typedef struct order_ctx {
+    bool descending;
+    size_t compares;
+    size_t freed;
+    int last;
+    size_t shown;
+} order_ctx;
+
+/**
+ * compare_int_ctx:
+ *      Compare ints ascending or descending as ctx says.
+ */
+static result compare_int_ctx(const void *a, const void *b, void *arg) {
+    order_ctx *ctx = arg;
+    result r = compare_int(a, b);
+
+    ctx->compares++;
+    return ctx->descending ? -r : r;
+}
+
+/**
+ * free_int_ctx:
+ *      Count freed elements in ctx.
+ */
+static void free_int_ctx(void *data __attribute__((unused)), void *arg) {
+    ((order_ctx *)arg)->freed++;
+}
+
+/**
+ * show_int_ctx:
+ *      Check elements are displayed in the order of ctx.
+ */
+static void show_int_ctx(void *data, void *arg) {
+    order_ctx *ctx = arg;
+    int key = *(int *)data;
+
+    if (ctx->shown++ &&
+        (ctx->descending ? key >= ctx->last : key <= ctx->last)) {
+        error_quit("displayed %d after %d", key, ctx->last);
+    }
+    ctx->last = key;
+}
+
+/**
+ * context_test:
+ *      Keep two trees of the same keys in opposite orders through the
+ *      context carrying functions.
+ */
+void context_test(uint64_t seed) {
+    bool present[KEY_RANGE];
+    int keys[KEY_RANGE];
+    size_t n = random_keys(&seed, KEY_RANGE, 50, present, keys);
+
+    printf("Ordering trees through a context\n");
+    for (int descending = 0; descending < 2; descending++) {
+        order_ctx ctx = {descending, 0, 0, 0, 0};
+        bst_node *root = NULL;
+
+        for (size_t i = 0; i < n; i++) {
+            intptr_t key = keys[(i * 7) % n];
+            root = bst_insert_r(root, sizeof(int), (void *)key,
+                                compare_int_ctx, &ctx);
+        }
+        if (bst_size(root) != n || !ctx.compares) {
+            error_quit("context tree has %zu of %zu keys", bst_size(root), n);
+        }
+
+        for (intptr_t key = 0; key < KEY_RANGE; key++) {
+            bst_node *node = bst_lookup_r(root, (void *)key, compare_int_ctx,
+                                          &ctx);
+            if (present[key] != (node != NULL)) {
+                error_quit("context lookup of %d failed", (int)key);
+            }
+        }
+
+        bst_traverse_inorder_r(root, show_int_ctx, &ctx);
+        if (ctx.shown != n) {
+            error_quit("context traversal showed %zu of %zu", ctx.shown, n);
+        }
+
+        // Remove every other key, then drop the rest
+        size_t removed = 0;
+        for (size_t i = 0; i < n; i += 2) {
+            root = bst_remove_node_r(root, (void *)(intptr_t)keys[i],
+                                     compare_int_ctx, free_int_ctx, &ctx);
+            removed++;
+        }
+        if (ctx.freed != removed || bst_size(root) != n - removed) {
+            error_quit("context remove freed %zu of %zu", ctx.freed, removed);
+        }
+
+        ctx.shown = 0;
+        bst_delete_tree_r(root, free_int_ctx, show_int_ctx, &ctx);
+        if (ctx.freed != n || ctx.shown != n - removed) {
+            error_quit("context delete freed %zu of %zu", ctx.freed, n);
+        }
+    }
+}
@@ -29,10 +29,16 @@ SOFTWARE.
 #include <string.h>
 
 void str_bst_test();
+void str_tree_test();
+void str_prefix_test();
+void str_owned_test();
 
 int main() {
     signal(SIGSEGV, sig_seg);
     str_bst_test();
+    str_tree_test();
+    str_prefix_test();
+    str_owned_test();
     exit(EXIT_SUCCESS);
 }
 
@@ -63,3 +69,232 @@ void str_bst_test() {
     printf("\n");
     fflush(stdout);
 }
+
+void str_tree_test() {
+    size_t limit = 7;
+    size_t i;
+    const char *initial_tree_values[] = {"hello", "cruel", "world", "I'm",
+                                         "hard",  "to",    "kill!"};
+    bst_tree *tree = bst_tree_new(sizeof(char *), compare_str, NULL);
+
+    for (i = 0; i < limit; i++) {
+        printf("Inserting into tree handle value: %s\n",
+               initial_tree_values[i]);
+        bst_tree_insert(tree, &initial_tree_values[i]);
+    }
+
+    if (bst_tree_insert(tree, &initial_tree_values[0])) {
+        error_quit("duplicate value was inserted");
+    }
+
+    const char *key = "cruel";
+    printf("\nRemoving value: %s\n", key);
+    if (!bst_tree_remove(tree, &key) || bst_tree_lookup(tree, &key)) {
+        error_quit("value was not removed");
+    }
+
+    printf("The size of the tree is %zu\n", bst_tree_size(tree));
+    if (bst_tree_size(tree) != bst_size(bst_tree_root(tree))) {
+        error_quit("cached size does not match the tree");
+    }
+
+    printf("\ninorder traversal:\n");
+    bst_traverse_inorder(bst_tree_root(tree), print_str);
+    printf("\n\n");
+
+    bst_tree_delete(tree, print_rm_str);
+    printf("\n");
+    fflush(stdout);
+}
+
+void str_prefix_test() {
+    // In strcmp order, bytes compare unsigned
+    const char *values[] = {"",           "a",           "ab",
+                            "abcdefg",    "abcdefgh",    "abcdefghi",
+                            "abcdefghj",  "abcdefgh\xff", "abcdefgi",
+                            "http://a/1", "http://a/10", "http://a/2",
+                            "http://b",   "zzzzzzzzzzz", "\xff"};
+    size_t limit = sizeof(values) / sizeof(*values);
+    size_t i, j;
+
+    printf("\nComparing prefix cached strings\n");
+    for (i = 0; i < limit; i++) {
+        for (j = 0; j < limit; j++) {
+            bst_str a = bst_str_key(values[i]);
+            bst_str b = bst_str_key(values[j]);
+
+            if (a.len != strlen(values[i]) ||
+                compare_str_prefix(&a, &b) !=
+                    compare_str(&values[i], &values[j])) {
+                error_quit("\"%s\" and \"%s\" compare differently",
+                           values[i], values[j]);
+            }
+        }
+    }
+
+    // Insert in reverse so the tree has to order them itself
+    bst_tree *tree = bst_tree_new_str(NULL);
+    for (i = limit; i-- > 0;) {
+        bst_str key = bst_str_key(values[i]);
+        bst_tree_insert(tree, &key);
+    }
+
+    for (i = 0; i < limit; i++) {
+        bst_str key = bst_str_key(values[i]);
+        const bst_str *found = bst_tree_lookup(tree, &key);
+        if (!found || found->str != values[i] ||
+            (i && compare_str(&values[i - 1], &values[i]) != LESSER)) {
+            error_quit("\"%s\" is not in the tree", values[i]);
+        }
+        if (bst_tree_select(tree, i) != found) {
+            error_quit("\"%s\" is out of order", values[i]);
+        }
+    }
+
+    bst_str key = bst_str_key("abcdefgh0");
+    if (bst_tree_lookup(tree, &key)) {
+        error_quit("found a string that was never inserted");
+    }
+
+    printf("inorder traversal:\n");
+    bst_traverse_inorder(bst_tree_root(tree), print_str);
+    printf("\n");
+
+    bst_tree_delete(tree, NULL);
+    fflush(stdout);
+}
+
+/**
+ * refuse_write:
+ *      Export callback failing the test if an owned tree gets this far.
+ */
+static bool refuse_write(const void *buf, size_t len, void *ctx) {
+    (void)buf;
+    (void)len;
+    (void)ctx;
+    error_quit("owned tree was exported");
+    return false;
+}
+
+/**
+ * refuse_read:
+ *      Import callback failing the test if an owned tree gets this far.
+ */
+static size_t refuse_read(void *buf, size_t len, void *ctx) {
+    (void)buf;
+    (void)len;
+    (void)ctx;
+    error_quit("owned tree was imported");
+    return 0;
+}
+
+void str_owned_test() {
+    size_t limit = 1000;
+    size_t i;
+    char buf[32];
+    bst_intern *intern = bst_intern_new();
+    bst_tree *own = bst_tree_new_owned_str(NULL);
+    bst_tree *other = bst_tree_new_owned_str(NULL);
+    bst_tree *shared[2] = {bst_tree_new_owned_str(intern),
+                           bst_tree_new_owned_str(intern)};
+
+    printf("\nCopying owned string keys\n");
+
+    // Every key is written to the same buffer, which the trees must copy
+    for (i = 0; i < limit; i++) {
+        snprintf(buf, sizeof(buf), "owned/key/%zu", i);
+        bst_str key = bst_str_key(buf);
+
+        bst_tree_insert(i % 2 ? own : other, &key);
+        bst_tree_insert(shared[i % 2], &key);
+        bst_tree_insert(shared[i % 3 == 0], &key);
+    }
+    memset(buf, 0, sizeof(buf));
+
+    if (bst_intern_size(intern) != limit) {
+        error_quit("intern table holds %zu of %zu strings",
+                   bst_intern_size(intern), limit);
+    }
+
+    for (i = 0; i < limit; i++) {
+        snprintf(buf, sizeof(buf), "owned/key/%zu", i);
+        bst_str key = bst_str_key(buf);
+        const bst_str *mine = bst_tree_lookup(i % 2 ? own : other, &key);
+        const bst_str *a = bst_tree_lookup(shared[0], &key);
+        const bst_str *b = bst_tree_lookup(shared[1], &key);
+
+        if (!mine || mine->str == buf || strcmp(mine->str, buf)) {
+            error_quit("owned key %s was not copied", buf);
+        }
+        if (a && b && a->str != b->str) {
+            error_quit("interned key %s has two copies", buf);
+        }
+        if (!a && !b) {
+            error_quit("interned key %s is missing", buf);
+        }
+    }
+
+    // Removing keys leaves the rest intact
+    for (i = 1; i < limit; i += 4) {
+        snprintf(buf, sizeof(buf), "owned/key/%zu", i);
+        bst_str key = bst_str_key(buf);
+        if (!bst_tree_remove(own, &key)) {
+            error_quit("owned key %s was not removed", buf);
+        }
+    }
+
+    // Union moves the keys of other into own before other is deleted
+    if (!bst_union(own, other) || bst_union(own, shared[0])) {
+        error_quit("union of owned trees went wrong");
+    }
+    bst_tree_delete(other, NULL);
+
+    const bst_str *prev = NULL;
+    for (i = 0; i < bst_tree_size(own); i++) {
+        const bst_str *key = bst_tree_select(own, i);
+        if (prev && strcmp(prev->str, key->str) >= 0) {
+            error_quit("owned keys %s and %s are out of order", prev->str,
+                       key->str);
+        }
+        prev = key;
+    }
+    printf("The size of the owned tree is %zu\n", bst_tree_size(own));
+    if (bst_tree_size(own) != limit - limit / 4) {
+        error_quit("owned tree lost keys");
+    }
+
+    // Building from an array copies too
+    bst_tree *built = bst_tree_new_owned_str(NULL);
+    bst_str keys[3];
+    char words[3][8] = {"pear", "apple", "fig"};
+    for (i = 0; i < 3; i++) {
+        keys[i] = bst_str_key(words[i]);
+    }
+    bst_tree_build_from_array(built, keys, 3);
+    memset(words, 0, sizeof(words));
+    printf("inorder traversal:\n");
+    bst_traverse_inorder(bst_tree_root(built), print_str);
+    printf("\n");
+    keys[0] = bst_str_key("fig");
+    if (!bst_tree_lookup(built, &keys[0])) {
+        error_quit("built owned tree lost its keys");
+    }
+
+    // Owned keys point into the tree's own strings, so they never leave it
+    printf("Refusing to stream or save owned keys\n");
+    bst_tree *empty = bst_tree_new_owned_str(NULL);
+    if (bst_tree_export(own, refuse_write, NULL) ||
+        bst_tree_export(shared[0], refuse_write, NULL) ||
+        bst_tree_import(empty, refuse_read, NULL) ||
+        bst_save(own, "test_bst_string_owned.bst")) {
+        error_quit("owned string keys were streamed or saved");
+    }
+    bst_tree_delete(empty, NULL);
+
+    bst_tree_delete(built, NULL);
+    bst_tree_delete(own, NULL);
+    bst_tree_delete(shared[0], NULL);
+    bst_tree_delete(shared[1], NULL);
+    bst_intern_delete(intern);
+    fflush(stdout);
+}
@@ -0,0 +1,140 @@
+/** test_bst_typed.c - Test of the macro generated typed trees.
+
+Copyright (c) 2024 Michael Berry
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "../include/bst_typed.h"
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define KEY_RANGE 1024
+#define OPERATIONS 20000
+
+BST_DEFINE(int_set, int, BST_CMP_NUMERIC(a, b))
+
+typedef struct order_check {
+    int last;
+    size_t seen;
+} order_check;
+
+uint64_t next_random(uint64_t *);
+size_t check_avl(const int_set_node *);
+void check_order(int *, void *);
+void typed_bst_test();
+
+int main() {
+    signal(SIGSEGV, sig_seg);
+    typed_bst_test();
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * next_random:
+ *      xorshift64* generator, reproducible across runs.
+ */
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * check_avl:
+ *      Verify stored heights and balance factors, return the height.
+ */
+size_t check_avl(const int_set_node *node) {
+    if (!node) {
+        return 0;
+    }
+
+    size_t l = check_avl(node->left);
+    size_t r = check_avl(node->right);
+
+    if (node->height != (l > r ? l : r) + 1 || l > r + 1 || r > l + 1) {
+        error_quit("key %d breaks the AVL invariants", node->key);
+    }
+
+    return node->height;
+}
+
+/**
+ * check_order:
+ *      Iteration visitor verifying keys arrive in increasing order.
+ */
+void check_order(int *key, void *arg) {
+    order_check *check = arg;
+
+    if (check->seen && *key <= check->last) {
+        error_quit("key %d visited after %d", *key, check->last);
+    }
+
+    check->last = *key;
+    check->seen++;
+}
+
+void typed_bst_test() {
+    bool present[KEY_RANGE] = {false};
+    uint64_t seed = 3;
+    int_set set;
+
+    int_set_init(&set);
+
+    printf("Running %d random typed tree operations\n", OPERATIONS);
+    for (size_t i = 0; i < OPERATIONS; i++) {
+        uint64_t r = next_random(&seed);
+        int key = (int)((r >> 8) % KEY_RANGE);
+
+        if (r & 1) {
+            if (int_set_insert(&set, key) == present[key]) {
+                error_quit("insert of %d reported the wrong result", key);
+            }
+            present[key] = true;
+        } else {
+            if (int_set_remove(&set, key) != present[key]) {
+                error_quit("remove of %d reported the wrong result", key);
+            }
+            present[key] = false;
+        }
+
+        check_avl(set.root);
+    }
+
+    size_t expected = 0;
+    for (int key = 0; key < KEY_RANGE; key++) {
+        if ((int_set_lookup(&set, key) != NULL) != present[key]) {
+            error_quit("key %d is in the wrong state", key);
+        }
+        expected += present[key];
+    }
+
+    order_check check = {0, 0};
+    int_set_iterate(&set, check_order, &check);
+    if (check.seen != expected || int_set_size(&set) != expected) {
+        error_quit("iterated %zu keys, expected %zu", check.seen, expected);
+    }
+    printf("Typed tree holds %zu keys\n", int_set_size(&set));
+
+    int_set_clear(&set);
+}